@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <inttypes.h>
+#include <emmintrin.h>
+
+// Runs every program given on the command line (a whole command line per argument, split on spaces)
+// into a counting pipe and into /dev/null, a few times each, and prints GB/s, lines/s, wall time, the
+// time to the first byte on the pipe and hardware counters as a table on stderr and as JSON.
+
+enum { SINK_PIPE, SINK_NULL, SINK_COUNT };
+const char* SINK_NAMES[] = { "pipe", "null" };
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES, COUNTER_LLC_LOAD_MISSES, COUNTER_LLC_STORE_MISSES, COUNTER_COUNT };
+const char* COUNTER_NAMES[] = { "cycles", "instructions", "llc_misses", "llc_load_misses", "llc_store_misses" };
+#define LLC_MISSES(op) (PERF_COUNT_HW_CACHE_LL | (op) << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+const uint32_t COUNTER_TYPES[] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+const uint64_t COUNTER_CONFIGS[] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, LLC_MISSES(PERF_COUNT_HW_CACHE_OP_READ), LLC_MISSES(PERF_COUNT_HW_CACHE_OP_WRITE) }; // store misses are the RFO reads streaming stores avoid
+
+#define MAX_TRIALS 100
+
+typedef struct {
+    const char* program;
+    int sink;
+    int trials;
+    double wall[MAX_TRIALS];
+    double first_byte[MAX_TRIALS]; // from fork to the first byte on the pipe, negative for /dev/null or no output at all
+    uint64_t bytes, lines; // of the last pipe trial, /dev/null can't count (with --sink=null an untimed pipe run does)
+    double counters[COUNTER_COUNT]; // mean over the trials, negative if perf_event_open isn't allowed
+    int failed; // exit status of the first failing trial
+} result_struct;
+
+int trials = 3;
+const char* json_path = "bench.json";
+int sinks[SINK_COUNT] = { 1, 1 };
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int open_counter(pid_t pid, uint32_t type, uint64_t config) // counts the child and every thread it creates, from its exec on
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && errno == EACCES) // perf_event_paranoid >= 2 only allows user space
+    {
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+uint64_t count_lines(const char* buffer, size_t len) // SSE2 only, a byte loop couldn't keep up with FizzBuzz
+{
+    uint64_t lines = 0;
+    size_t i = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buffer + i)), newline)));
+    for (; i < len; i++) lines += buffer[i] == '\n';
+    return lines;
+}
+
+int run_trial(char** argv, int sink, double* wall, double* first_byte, uint64_t* bytes, uint64_t* lines, double* counters) // returns the exit status
+{
+    int go[2], out[2] = { -1, -1 };
+    if (pipe2(go, O_CLOEXEC) != 0 || (sink == SINK_PIPE && pipe(out) != 0))
+    {
+        perror("pipe");
+        exit(1);
+    }
+    if (sink == SINK_PIPE) fcntl(out[0], F_SETPIPE_SZ, 1 << 20);
+    const double start = now();
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        char c;
+        const int fd = sink == SINK_PIPE ? out[1] : open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        if (sink == SINK_PIPE) close(out[0]);
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1) _exit(127); // the counters have to be attached before exec
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    int fds[COUNTER_COUNT];
+    for (int i = 0; i < COUNTER_COUNT; i++) fds[i] = open_counter(pid, COUNTER_TYPES[i], COUNTER_CONFIGS[i]);
+    close(go[0]);
+    if (write(go[1], "x", 1) != 1) perror("write");
+    close(go[1]);
+    *bytes = *lines = 0;
+    *first_byte = -1;
+    if (sink == SINK_PIPE)
+    {
+        static char buffer[1 << 20];
+        close(out[1]);
+        ssize_t n;
+        while ((n = read(out[0], buffer, sizeof(buffer))) != 0)
+        {
+            if (n < 0)
+            {
+                if (errno == EINTR) continue;
+                perror("read");
+                break;
+            }
+            if (!*bytes) *first_byte = now() - start; // what a caller asking for a few lines waits for
+            *bytes += n;
+            *lines += count_lines(buffer, n);
+        }
+        close(out[0]);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    *wall = now() - start;
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        uint64_t value;
+        counters[i] = fds[i] >= 0 && read(fds[i], &value, sizeof(value)) == sizeof(value) ? (double)value : -1;
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+char** split_command(const char* command)
+{
+    char* copy = strdup(command);
+    char** argv = calloc(strlen(command) / 2 + 2, sizeof(char*));
+    int argc = 0;
+    for (char* token = strtok(copy, " "); token; token = strtok(NULL, " ")) argv[argc++] = token;
+    return argv;
+}
+
+double mean(const double* values, int count)
+{
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += values[i];
+    return sum / count;
+}
+
+double stddev(const double* values, int count)
+{
+    if (count < 2) return 0;
+    const double m = mean(values, count);
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += (values[i] - m) * (values[i] - m);
+    return sqrt(sum / (count - 1));
+}
+
+double first_byte_mean(const result_struct* r) // negative if no trial saw a byte
+{
+    double sum = 0;
+    int count = 0;
+    for (int t = 0; t < r->trials; t++) if (r->first_byte[t] >= 0) sum += r->first_byte[t], count++;
+    return count ? sum / count : -1;
+}
+
+double memory_bytes(const result_struct* r) // a line per last level cache miss, loads and stores (RFOs) alike
+{
+    return (r->counters[COUNTER_LLC_LOAD_MISSES] + r->counters[COUNTER_LLC_STORE_MISSES]) * 64;
+}
+ 
+void json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void write_json(const result_struct* results, int count)
+{
+    FILE* f = strcmp(json_path, "-") ? fopen(json_path, "w") : stdout;
+    if (!f)
+    {
+        perror(json_path);
+        exit(1);
+    }
+    fprintf(f, "{\n  \"trials\": %d,\n  \"results\": [\n", trials);
+    for (int i = 0; i < count; i++)
+    {
+        const result_struct* r = &results[i];
+        const double m = mean(r->wall, r->trials);
+        fprintf(f, "    {\"program\": ");
+        json_string(f, r->program);
+        fprintf(f, ", \"sink\": \"%s\", \"exit_status\": %d, \"bytes\": %" PRIu64 ", \"lines\": %" PRIu64 ", ", SINK_NAMES[r->sink], r->failed, r->bytes, r->lines);
+        fprintf(f, "\"wall_s\": {\"mean\": %.6f, \"stddev\": %.6f, \"runs\": [", m, stddev(r->wall, r->trials));
+        for (int t = 0; t < r->trials; t++) fprintf(f, "%s%.6f", t ? ", " : "", r->wall[t]);
+        fprintf(f, "]}, \"gb_per_s\": %.4f, \"lines_per_s\": %.1f", r->bytes / m / 1e9, r->lines / m);
+        if (first_byte_mean(r) < 0) fprintf(f, ", \"first_byte_s\": null");
+        else
+        {
+            fprintf(f, ", \"first_byte_s\": {\"mean\": %.6f, \"runs\": [", first_byte_mean(r));
+            for (int t = 0; t < r->trials; t++) fprintf(f, "%s%.6f", t ? ", " : "", r->first_byte[t]);
+            fprintf(f, "]}");
+        }
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            if (r->counters[c] < 0) fprintf(f, ", \"%s\": null", COUNTER_NAMES[c]);
+            else fprintf(f, ", \"%s\": %.0f", COUNTER_NAMES[c], r->counters[c]);
+        }
+        if (r->counters[COUNTER_LLC_LOAD_MISSES] < 0 || r->counters[COUNTER_LLC_STORE_MISSES] < 0) fprintf(f, ", \"memory_gb_per_s\": null");
+        else fprintf(f, ", \"memory_gb_per_s\": %.4f", memory_bytes(r) / m / 1e9);
+        fprintf(f, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (f != stdout) fclose(f);
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [--trials=N] [--json=FILE] [--sink=pipe|null|both] \"PROGRAM [ARGS]\"...\n"
+                    "  --trials=N   runs per program and sink (default 3)\n"
+                    "  --json=FILE  where the results go, - for stdout (default bench.json)\n"
+                    "  --sink=S     pipe: a counting reader, null: /dev/null (counted by one extra untimed pipe run), both (default)\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int first_program = argc;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strncmp(argv[i], "--trials=", 9))
+        {
+            trials = atoi(argv[i] + 9);
+            if (trials < 1 || trials > MAX_TRIALS) usage(argv[0]);
+        }
+        else if (!strncmp(argv[i], "--json=", 7)) json_path = argv[i] + 7;
+        else if (!strcmp(argv[i], "--sink=pipe")) sinks[SINK_NULL] = 0;
+        else if (!strcmp(argv[i], "--sink=null")) sinks[SINK_PIPE] = 0;
+        else if (!strcmp(argv[i], "--sink=both")) sinks[SINK_PIPE] = sinks[SINK_NULL] = 1;
+        else if (!strncmp(argv[i], "--", 2)) usage(argv[0]);
+        else
+        {
+            first_program = i;
+            break;
+        }
+    }
+    if (first_program == argc) usage(argv[0]);
+    result_struct* results = calloc((argc - first_program) * SINK_COUNT, sizeof(result_struct));
+    int count = 0, perf_warned = 0;
+    fprintf(stderr, "%-40s %-5s %12s %10s %14s %10s %8s %12s %14s %14s %12s %12s %12s %10s\n", "program", "sink", "GB", "GB/s", "lines/s", "wall s", "+-", "1st byte ms", "cycles", "instructions", "LLC misses", "LLC loads", "LLC stores", "mem GB/s");
+    for (int p = first_program; p < argc; p++)
+    {
+        char** command = split_command(argv[p]);
+        uint64_t pipe_bytes = 0, pipe_lines = 0;
+        int pipe_failed = 0;
+        if (!sinks[SINK_PIPE]) // /dev/null only: one untimed pipe run counts what the trials write
+        {
+            double wall, first_byte, counters[COUNTER_COUNT];
+            pipe_failed = run_trial(command, SINK_PIPE, &wall, &first_byte, &pipe_bytes, &pipe_lines, counters);
+        }
+        for (int sink = 0; sink < SINK_COUNT; sink++)
+        {
+            if (!sinks[sink]) continue;
+            result_struct* r = &results[count++];
+            r->program = argv[p];
+            r->sink = sink;
+            r->trials = trials;
+            double sums[COUNTER_COUNT] = { 0 };
+            for (int t = 0; t < trials; t++)
+            {
+                double counters[COUNTER_COUNT];
+                const int status = run_trial(command, sink, &r->wall[t], &r->first_byte[t], &r->bytes, &r->lines, counters);
+                if (status && !r->failed) r->failed = status;
+                for (int c = 0; c < COUNTER_COUNT; c++) sums[c] = sums[c] < 0 || counters[c] < 0 ? -1 : sums[c] + counters[c];
+            }
+            for (int c = 0; c < COUNTER_COUNT; c++) r->counters[c] = sums[c] < 0 ? -1 : sums[c] / trials;
+            if (sink == SINK_PIPE)
+            {
+                pipe_bytes = r->bytes;
+                pipe_lines = r->lines;
+                pipe_failed = r->failed;
+            }
+            else // same program, same output: what the pipe counted
+            {
+                r->bytes = pipe_bytes;
+                r->lines = pipe_lines;
+                if (!r->failed) r->failed = pipe_failed; // the count is only as good as the run it came from
+            }
+            if (r->counters[COUNTER_CYCLES] < 0 && !perf_warned++) fprintf(stderr, "perf_event_open failed (kernel.perf_event_paranoid?), no hardware counters\n");
+            const double m = mean(r->wall, r->trials);
+            fprintf(stderr, "%-40.40s %-5s %12.3f %10.3f %14.0f %10.3f %8.3f", r->program, SINK_NAMES[sink], r->bytes / 1e9, r->bytes / m / 1e9, r->lines / m, m, stddev(r->wall, r->trials));
+            if (first_byte_mean(r) < 0) fprintf(stderr, " %12s", "n/a");
+            else fprintf(stderr, " %12.3f", first_byte_mean(r) * 1e3);
+            for (int c = 0; c < COUNTER_COUNT; c++)
+            {
+                if (r->counters[c] < 0) fprintf(stderr, " %*s", c >= COUNTER_LLC_MISSES ? 12 : 14, "n/a");
+                else fprintf(stderr, " %*.0f", c >= COUNTER_LLC_MISSES ? 12 : 14, r->counters[c]);
+            }
+            if (r->counters[COUNTER_LLC_LOAD_MISSES] < 0 || r->counters[COUNTER_LLC_STORE_MISSES] < 0) fprintf(stderr, " %10s", "n/a");
+            else fprintf(stderr, " %10.3f", memory_bytes(r) / m / 1e9);
+            fprintf(stderr, "%s\n", r->failed ? "  FAILED" : "");
+        }
+        free(command[0]);
+        free(command);
+    }
+    write_json(results, count);
+    for (int i = 0; i < count; i++) if (results[i].failed) return 1;
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <string.h>
+#include "Encoder.h"
+
+enum { PP_NONE, PP_66, PP_F3, PP_F2 }; // implied legacy prefix
+enum { MAP_0F = 1, MAP_0F38, MAP_0F3A }; // opcode map
+
+operand vreg(int reg)
+{
+    return (operand){ OPERAND_REG, reg, 0, NULL };
+}
+
+operand mem(int base, int32_t disp)
+{
+    return (operand){ OPERAND_MEM, base, disp, NULL };
+}
+
+operand rip(const void* target)
+{
+    return (operand){ OPERAND_RIP, 0, 0, target };
+}
+
+int take_register(uint32_t* pool)
+{
+    if (!*pool) return -1;
+    const int reg = __builtin_ctz(*pool);
+    *pool &= *pool - 1;
+    return reg;
+}
+
+static void emit_modrm(encoder_struct* e, int reg, operand rm, int imm_bytes) // plus the displacement; EVEX scales 8 bit ones by the vector width
+{
+    const int scale = e->evex ? 64 : 1;
+    if (rm.kind == OPERAND_REG) *e->ptr++ = 0xC0 | (reg & 7) << 3 | (rm.reg & 7);
+    else if (rm.kind == OPERAND_RIP)
+    {
+        *e->ptr++ = (reg & 7) << 3 | 5;
+        const int32_t disp = rm.target - (e->ptr + 4 + imm_bytes); // from the end of the instruction
+        memcpy(e->ptr, &disp, 4);
+        e->ptr += 4;
+    }
+    else if (rm.disp == 0 && (rm.reg & 7) != RBP) *e->ptr++ = (reg & 7) << 3 | (rm.reg & 7);
+    else if (rm.disp % scale == 0 && rm.disp / scale >= -128 && rm.disp / scale <= 127)
+    {
+        *e->ptr++ = 0x40 | (reg & 7) << 3 | (rm.reg & 7);
+        *e->ptr++ = rm.disp / scale;
+    }
+    else
+    {
+        *e->ptr++ = 0x80 | (reg & 7) << 3 | (rm.reg & 7);
+        memcpy(e->ptr, &rm.disp, 4);
+        e->ptr += 4;
+    }
+}
+
+static void emit_vex(encoder_struct* e, int pp, int map, int w, int l, int opcode, int reg, int vvvv, operand rm, int imm_bytes)
+{
+    const int b = rm.kind != OPERAND_RIP && (rm.reg & 8);
+    if (map == MAP_0F && !w && !b) // the 2 byte form
+    {
+        *e->ptr++ = 0xC5;
+        *e->ptr++ = !(reg & 8) << 7 | (~vvvv & 15) << 3 | l << 2 | pp;
+    }
+    else
+    {
+        *e->ptr++ = 0xC4;
+        *e->ptr++ = !(reg & 8) << 7 | 1 << 6 | !b << 5 | map;
+        *e->ptr++ = w << 7 | (~vvvv & 15) << 3 | l << 2 | pp;
+    }
+    *e->ptr++ = opcode;
+    emit_modrm(e, reg, rm, imm_bytes);
+}
+
+static void emit_evex(encoder_struct* e, int pp, int map, int w, int opcode, int reg, int vvvv, operand rm, int k, int imm_bytes) // always 512 bit
+{
+    const int b = rm.kind != OPERAND_RIP && (rm.reg & 8), x = rm.kind == OPERAND_REG && (rm.reg & 16); // a register operand's 5th bit goes into X
+    *e->ptr++ = 0x62;
+    *e->ptr++ = !(reg & 8) << 7 | !x << 6 | !b << 5 | !(reg & 16) << 4 | map;
+    *e->ptr++ = w << 7 | (~vvvv & 15) << 3 | 1 << 2 | pp;
+    *e->ptr++ = 2 << 5 | !(vvvv & 16) << 3 | k;
+    *e->ptr++ = opcode;
+    emit_modrm(e, reg, rm, imm_bytes);
+}
+
+static void emit_vector(encoder_struct* e, int pp, int map, int evex_w, int opcode, int reg, int vvvv, operand rm) // W only matters for EVEX here, VEX ignores it for all of these
+{
+    if (e->evex) emit_evex(e, pp, map, evex_w, opcode, reg, vvvv, rm, 0, 0);
+    else emit_vex(e, pp, map, 0, 1, opcode, reg, vvvv, rm, 0);
+}
+
+void emit_vmovdqa(encoder_struct* e, int dst, operand src)
+{
+    emit_vector(e, PP_66, MAP_0F, 1, 0x6F, dst, 0, src);
+}
+
+void emit_vmovdqu_store(encoder_struct* e, operand dst, int src)
+{
+    emit_vector(e, PP_F3, MAP_0F, 1, 0x7F, src, 0, dst);
+}
+
+void emit_vmovntdq(encoder_struct* e, operand dst, int src)
+{
+    emit_vector(e, PP_66, MAP_0F, 0, 0xE7, src, 0, dst);
+}
+
+void emit_vpshufb(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F38, 0, 0x00, dst, a, b);
+}
+
+void emit_vpaddb(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F, 0, 0xFC, dst, a, b);
+}
+
+void emit_vpsubb(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F, 0, 0xF8, dst, a, b);
+}
+
+void emit_vpaddq(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F, 1, 0xD4, dst, a, b);
+}
+
+void emit_vpsubq(encoder_struct* e, int dst, int a, operand b, int k)
+{
+    if (e->evex) emit_evex(e, PP_66, MAP_0F, 1, 0xFB, dst, a, b, k, 0);
+    else emit_vex(e, PP_66, MAP_0F, 0, 1, 0xFB, dst, a, b, 0);
+}
+
+void emit_vpmaxub(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F, 0, 0xDE, dst, a, b);
+}
+
+void emit_vpxor(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F, 0, 0xEF, dst, a, b);
+}
+
+void emit_vpcmpeqq(encoder_struct* e, int dst, int a, operand b)
+{
+    emit_vector(e, PP_66, MAP_0F38, 1, 0x29, dst, a, b);
+}
+
+void emit_vpslldq(encoder_struct* e, int dst, int src, int bytes) // 73 /7 ib, the destination goes into vvvv
+{
+    if (e->evex) emit_evex(e, PP_66, MAP_0F, 0, 0x73, 7, dst, vreg(src), 0, 1);
+    else emit_vex(e, PP_66, MAP_0F, 0, 1, 0x73, 7, dst, vreg(src), 1);
+    *e->ptr++ = bytes;
+}
+
+void emit_vpternlogd(encoder_struct* e, int dst, int a, operand b, int table)
+{
+    emit_evex(e, PP_66, MAP_0F3A, 0, 0x25, dst, a, b, 0, 1);
+    *e->ptr++ = table;
+}
+
+void emit_kshiftlw(encoder_struct* e, int dst, int src, int bits)
+{
+    emit_vex(e, PP_66, MAP_0F3A, 1, 0, 0x32, dst, 0, vreg(src), 1);
+    *e->ptr++ = bits;
+}
+
+static void emit_group1(encoder_struct* e, int rex_w, int ext, int reg, int32_t imm) // add, sub, cmp... with an immediate
+{
+    if (rex_w) *e->ptr++ = 0x48;
+    const int short_imm = imm >= -128 && imm <= 127;
+    *e->ptr++ = short_imm ? 0x83 : 0x81;
+    *e->ptr++ = 0xC0 | ext << 3 | reg;
+    if (short_imm) *e->ptr++ = imm;
+    else
+    {
+        memcpy(e->ptr, &imm, 4);
+        e->ptr += 4;
+    }
+}
+
+void emit_add(encoder_struct* e, int reg, int32_t imm)
+{
+    emit_group1(e, 1, 0, reg, imm);
+}
+
+void emit_sub(encoder_struct* e, int reg, int32_t imm)
+{
+    emit_group1(e, 0, 5, reg, imm);
+}
+
+void emit_cmp(encoder_struct* e, int reg, int32_t imm)
+{
+    emit_group1(e, 0, 7, reg, imm);
+}
+
+void emit_dec(encoder_struct* e, int reg)
+{
+    *e->ptr++ = 0xFF;
+    *e->ptr++ = 0xC8 | reg;
+}
+
+void emit_test(encoder_struct* e, int reg)
+{
+    *e->ptr++ = 0x85;
+    *e->ptr++ = 0xC0 | reg << 3 | reg;
+}
+
+uint8_t* emit_jcc(encoder_struct* e, int cc, const uint8_t* target)
+{
+    *e->ptr++ = 0x0F;
+    *e->ptr++ = 0x80 | cc;
+    uint8_t* rel = e->ptr;
+    e->ptr += 4;
+    set_jump(rel, target ? target : e->ptr);
+    return rel;
+}
+
+void set_jump(uint8_t* rel, const uint8_t* target)
+{
+    const int32_t distance = target - (rel + 4);
+    memcpy(rel, &distance, 4);
+}
+
+void emit_mov(encoder_struct* e, int dst, int src)
+{
+    *e->ptr++ = 0x48;
+    *e->ptr++ = 0x89;
+    *e->ptr++ = 0xC0 | src << 3 | dst;
+}
+
+void emit_vzeroupper(encoder_struct* e)
+{
+    *e->ptr++ = 0xC5; *e->ptr++ = 0xF8; *e->ptr++ = 0x77;
+}
+
+void emit_ret(encoder_struct* e)
+{
+    *e->ptr++ = 0xC3;
+}
@@ -0,0 +1,57 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+#include <stdint.h>
+
+// Just enough x86-64 for the JIT kernels: the vector instructions they use, in their VEX (ymm) and EVEX (zmm) forms,
+// and the few general purpose ones around the loop. Registers are plain numbers, so the kernel generator can hand
+// them out as it needs them instead of having them baked into the bytes.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI }; // as numbered in the ModRM byte
+enum { JB = 0x2, JAE = 0x3, JE = 0x4, JNE = 0x5 }; // condition codes
+enum { OPERAND_REG, OPERAND_MEM, OPERAND_RIP };
+
+typedef struct {
+    int kind;
+    int reg; // the vector register, or the base register of a memory operand (not rsp or r12)
+    int32_t disp;
+    const uint8_t* target; // of a rip relative operand
+} operand;
+
+typedef struct {
+    uint8_t* ptr; // where the next instruction goes
+    int evex; // zmm registers 0..31 and EVEX encodings, else ymm 0..15 and VEX
+} encoder_struct;
+
+operand vreg(int reg);
+operand mem(int base, int32_t disp);
+operand rip(const void* target);
+
+int take_register(uint32_t* pool); // lowest free register in the pool (bit r set: r is free), -1 if there is none
+
+void emit_vmovdqa(encoder_struct* e, int dst, operand src); // vmovdqa64 for EVEX
+void emit_vmovdqu_store(encoder_struct* e, operand dst, int src); // vmovdqu64 for EVEX
+void emit_vmovntdq(encoder_struct* e, operand dst, int src); // dst aligned to the vector width
+void emit_vpshufb(encoder_struct* e, int dst, int a, operand b);
+void emit_vpaddb(encoder_struct* e, int dst, int a, operand b);
+void emit_vpsubb(encoder_struct* e, int dst, int a, operand b);
+void emit_vpaddq(encoder_struct* e, int dst, int a, operand b);
+void emit_vpsubq(encoder_struct* e, int dst, int a, operand b, int k); // EVEX: merge masked by k1..k7 unless k is 0
+void emit_vpmaxub(encoder_struct* e, int dst, int a, operand b);
+void emit_vpxor(encoder_struct* e, int dst, int a, operand b); // vpxord for EVEX
+void emit_vpcmpeqq(encoder_struct* e, int dst, int a, operand b); // EVEX: dst is a mask register
+void emit_vpslldq(encoder_struct* e, int dst, int src, int bytes);
+void emit_vpternlogd(encoder_struct* e, int dst, int a, operand b, int table); // EVEX only
+void emit_kshiftlw(encoder_struct* e, int dst, int src, int bits);
+
+void emit_add(encoder_struct* e, int reg, int32_t imm); // 64 bit
+void emit_sub(encoder_struct* e, int reg, int32_t imm); // 32 bit, like the other two below
+void emit_cmp(encoder_struct* e, int reg, int32_t imm);
+void emit_dec(encoder_struct* e, int reg);
+void emit_test(encoder_struct* e, int reg);
+uint8_t* emit_jcc(encoder_struct* e, int cc, const uint8_t* target); // target NULL: returns where set_jump() has to put it later
+void set_jump(uint8_t* rel, const uint8_t* target);
+void emit_mov(encoder_struct* e, int dst, int src); // 64 bit
+void emit_vzeroupper(encoder_struct* e);
+void emit_ret(encoder_struct* e);
+
+#endif
@@ -1,249 +1,1455 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 #include <inttypes.h>
 #include <immintrin.h>
 #include <stdalign.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include "Generator.h"
  
-#define LINES_PER_THREAD 450000 // has to be a multiple of 300, should be changed around to fit your PC
-#define NUM_THREADS 4 // change according to your PC
+int num_threads; // defaults to the number of CPUs we are allowed to run on
+int threads_given = 0; // from --threads, FIZZBUZZ_THREADS or the profile, the range doesn't decide it then
+int lines_per_thread = 450000; // per round over all workers, each chunk gets lines_per_thread / num_threads; always a multiple of the period
 
-__m256i ONE, VEC_198, VEC_246;
+uint64_t start_line = 1, end_line = 1000000000; // inclusive, anything up to 2^64 - 1
  
-static __m256i shuffles[1000];
-uint8_t shuffle_idx = 0;
+rule_struct rules[16] = { { 3, "Fizz", 4 }, { 5, "Buzz", 4 } }; // from --rules, the generator keeps its own copy
+int rule_count = 2;
+fb_handle* generator; // the rules, their kernels and the seek layer, set up by parse_options()
  
-const char Fizz[] = "Fizz\n", Buzz[] = "Buzz\n", FizzBuzz[] = "FizzBuzz\n";
+int out_fd = STDOUT_FILENO, out_is_pipe = 0, out_is_file = 0;
+int use_vmsplice = 0; // --vmsplice: hand the pipe our buffer pages instead of copying them, only safe if the reader copies them out
+uint64_t bytes_pushed = 0; // bytes_pushed counts every byte handed to the kernel so far
+const char* output_path = NULL;
+uint64_t file_base; // where start_line goes in the file, for pwrite and mmap output
+int direct_io = 0, direct_fd = -1; // whole pages go through direct_fd, opened with O_DIRECT
+#define DIRECT_ALIGN 4096 // a page, so the edges written through the page cache never share a page with a direct write
  
-int digits;
+void output_init()
+{
+    if (output_path && (out_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        perror(output_path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && !(fcntl(out_fd, F_GETFL) & O_APPEND)) // pwrite ignores the offset on O_APPEND descriptors
+    {
+        out_is_file = 1;
+        char fd_path[64];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", out_fd);
+        if (direct_io && (direct_fd = open(fd_path, O_WRONLY | O_DIRECT)) < 0) perror("O_DIRECT not available, writing through the page cache");
+        return;
+    }
+    if (direct_io) fprintf(stderr, "--direct only applies to regular files\n");
+    if (fstat(out_fd, &st) != 0 || !S_ISFIFO(st.st_mode)) return; // ttys, /dev/null... get plain write(2)
+    out_is_pipe = 1;
+    int max_size = 1 << 20;
+    FILE* f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f)
+    {
+        if (fscanf(f, "%d", &max_size) != 1) max_size = 1 << 20;
+        fclose(f);
+    }
+    while (max_size > 4096 && fcntl(out_fd, F_SETPIPE_SZ, max_size) < 0) max_size >>= 1; // an unprivileged process may be limited below pipe-max-size
+}
+ 
+void output_write(const char* buffer, size_t len) // copies the bytes, the buffer can be reused as soon as this returns
+{
+    while (len > 0)
+    {
+        ssize_t n = write(out_fd, buffer, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EPIPE) perror("write");
+            exit(errno == EPIPE ? 0 : 1);
+        }
+        buffer += n;
+        len -= n;
+        bytes_pushed += n;
+    }
+}
+ 
+uint64_t output_push(char* buffer, size_t len) // returns the stream position the reader has to pass before the buffer can be overwritten, 0 if it was copied
+{
+    if (!out_is_pipe || !use_vmsplice)
+    {
+        output_write(buffer, len);
+        return 0;
+    }
+    struct iovec iov = { buffer, len };
+    while (iov.iov_len > 0)
+    {
+        ssize_t n = vmsplice(out_fd, &iov, 1, 0); // the pipe references our pages, the writer waits for output_consumed() to pass them before they are filled again
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) exit(0);
+            use_vmsplice = 0; // vmsplice not supported on this fd after all, copy the rest
+            output_write(iov.iov_base, iov.iov_len);
+            return bytes_pushed;
+        }
+        iov.iov_base = (char*)iov.iov_base + n;
+        iov.iov_len -= n;
+        bytes_pushed += n;
+    }
+    return bytes_pushed;
+}
+ 
+void pwrite_all(int fd, const char* buffer, size_t len, uint64_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("pwrite");
+            exit(1);
+        }
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+}
+ 
+void output_pwrite(const char* buffer, size_t len, uint64_t offset) // buffer has to sit at offset % DIRECT_ALIGN in its page when direct_fd is open
+{
+    if (direct_fd < 0)
+    {
+        pwrite_all(out_fd, buffer, len, offset);
+        return;
+    }
+    size_t head = (DIRECT_ALIGN - offset % DIRECT_ALIGN) % DIRECT_ALIGN;
+    if (head > len) head = len;
+    const size_t pages = (len - head) / DIRECT_ALIGN * DIRECT_ALIGN;
+    pwrite_all(out_fd, buffer, head, offset);
+    pwrite_all(direct_fd, buffer + head, pages, offset + head);
+    pwrite_all(out_fd, buffer + head + pages, len - head - pages, offset + head + pages);
+}
+ 
+int mmap_output = 0, mmap_flush = 0, mmap_huge = 0;
+char* out_map = NULL; // the output file from map_offset on, the workers' kernels store straight into the page cache
+uint64_t map_offset;
+ 
+void output_map(uint64_t file_end) // falls back to pwrite if the file can't be mapped
+{
+    map_offset = file_base / 4096 * 4096;
+    if (ftruncate(out_fd, file_end) != 0)
+    {
+        perror("ftruncate");
+        return;
+    }
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", out_fd);
+    const int map_fd = open(fd_path, O_RDWR); // a shared writable mapping needs a descriptor open for reading too, stdout usually isn't
+    void* map = map_fd < 0 ? MAP_FAILED : mmap(NULL, file_end - map_offset, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, map_offset);
+    if (map_fd >= 0) close(map_fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap of the output file failed, using pwrite");
+        return;
+    }
+    out_map = map;
+    madvise(out_map, file_end - map_offset, MADV_SEQUENTIAL);
+    if (mmap_huge && madvise(out_map, file_end - map_offset, MADV_HUGEPAGE) != 0) perror("MADV_HUGEPAGE"); // only shmem (tmpfs mounted with huge=) backs files with huge pages
+}
+ 
+void output_flush(uint64_t begin, uint64_t end, int wait) // starts writeback of the whole pages in [begin, end), with wait it also waits for it and unmaps them
+{
+    begin = (begin + 4095) / 4096 * 4096;
+    end = end / 4096 * 4096;
+    if (end <= begin) return;
+    sync_file_range(out_fd, begin, end - begin, wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE);
+    if (wait) madvise(out_map + (begin - map_offset), end - begin, MADV_DONTNEED); // clean now, so this only drops our mapping of them and the kernel is free to reclaim
+}
+ 
+uint64_t output_consumed() // the stream position the reader has got to, one FIONREAD
+{
+    int unread;
+    if (ioctl(out_fd, FIONREAD, &unread) != 0) unread = 0;
+    return bytes_pushed - unread;
+}
+ 
+void output_wait_consumed(uint64_t release) // a spliced buffer stays referenced by the pipe until the reader consumed everything up to `release`
+{
+    while (output_consumed() < release) // a reader that splices the pages on (pv, tee, splice relays) still holds them after that, which is why --vmsplice is opt in
+    {
+        struct pollfd pfd = { out_fd, POLLOUT, 0 };
+        if (poll(&pfd, 1, 1) > 0 && (pfd.revents & (POLLERR | POLLHUP))) return; // the reader is gone, nobody looks at these pages anymore
+        usleep(20);
+    }
+}
  
-uint8_t *opcode, *opcode_ptr;
-typedef uint8_t* (*opcode_function)(uint8_t*, int);
-static opcode_function opcode_exec;
+#define URING_ENTRIES 64 // also the most chunks in one linked batch
  
-int8_t bytecode[3000], * bytecode_ptr = bytecode;
-int CODE_SIZE;
+typedef struct {
+    int fd;
+    unsigned* sq_tail, * sq_mask, * sq_array;
+    unsigned* cq_head, * cq_tail, * cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    int fixed; // the buffers are registered, writes go through IORING_OP_WRITE_FIXED
+} uring_struct;
  
-char string[3000], * string_ptr;
+int use_uring = 0;
+uring_struct uring = { .fd = -1 };
  
-void set_constants()
+int uring_init(struct iovec* buffers, int count) // no liburing, just the three syscalls; 0 if the kernel (or a seccomp filter) says no
 {
-    memset(bytecode, 0, sizeof(bytecode));
-    ONE = _mm256_set_epi64x(0, 1, 0, 1);
-    VEC_246 = _mm256_set1_epi8(246);
-    VEC_198 = _mm256_set_epi8(198, 198, 198, 198, 198, 198, 198, 190, 191, 192, 193, 194, 195, 196, 197, 198, 198, 198, 198, 198, 198, 198, 198, 190, 191, 192, 193, 194, 195, 196, 197, 198);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd < 0) return 0;
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) // offset -1 has to mean the file position, pipes and sockets have nothing else
+    {
+        close(uring.fd);
+        uring.fd = -1;
+        return 0;
+    }
+    const size_t sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned), cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uint8_t* sq = mmap(NULL, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uint8_t* cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq : mmap(NULL, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED || (params.features & IORING_FEAT_SINGLE_MMAP && cq_bytes > sq_bytes))
+    {
+        close(uring.fd);
+        uring.fd = -1;
+        return 0;
+    }
+    uring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    uring.fixed = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, buffers, count) == 0; // pins them, RLIMIT_MEMLOCK may be too small
+    return 1;
+}
+ 
+void uring_write(int index, char* buffer, size_t len, int link) // queues a write at the current position, index is the registered buffer
+{
+    const unsigned tail = *uring.sq_tail, slot = tail & *uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = uring.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = out_fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)buffer;
+    sqe->len = len;
+    sqe->buf_index = index;
+    sqe->flags = link ? IOSQE_IO_LINK : 0; // linked writes start only once the previous one completed, so they land in order
+    sqe->user_data = tail;
+    uring.sq_array[slot] = slot;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
 }
  
-void generate_opcode()
+void uring_complete(int count, int* results) // submits the queued writes and waits for all of them, results in submission order
 {
-    opcode_ptr = opcode;
-    uint32_t offset = 0, rip_distance;
-    __m256i* shuffles_ptr = shuffles;
-    for (int i = 0; i < CODE_SIZE; i++)
+    int submitted = 0, reaped = 0;
+    const unsigned first = *uring.sq_tail - count;
+    while (reaped < count)
     {
-        int8_t c = bytecode[i];
-        if (c == 1)
+        const int n = syscall(__NR_io_uring_enter, uring.fd, count - submitted, count - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0)
         {
-            *opcode_ptr++ = 0xC5; *opcode_ptr++ = 0x7D; *opcode_ptr++ = 0x6F; *opcode_ptr++ = 0x35; // |
-            rip_distance = (uint8_t*)(shuffles_ptr) - (opcode_ptr + 4);                             // |
-            memcpy(opcode_ptr, &rip_distance, 4);                                                   // |
-            opcode_ptr += 4;                                                                        // | = vmovdqa ymm14, YMMWORD PTR [shuffles_ptr] (or vmovdqa ymm14, YMMWORD PTR [rip + ((uint8_t*)(shuffles_ptr) - (uint8_t*)(opcode_ptr + 4))]) 
-            *opcode_ptr++ = 0xC4; *opcode_ptr++ = 0x42; *opcode_ptr++ = 0x15; *opcode_ptr++ = 0x00; *opcode_ptr++ = 0xFE;   // vpshufb ymm15, ymm13, ymm14
-            *opcode_ptr++ = 0xC4; *opcode_ptr++ = 0x41; *opcode_ptr++ = 0x05; *opcode_ptr++ = 0xF8; *opcode_ptr++ = 0xFE;   // vpsubb ymm15, ymm15, ymm14
-            *opcode_ptr++ = 0xC5; *opcode_ptr++ = 0x7E; *opcode_ptr++ = 0x7F; *opcode_ptr++ = 0xBF; memcpy(opcode_ptr, &offset, 4); opcode_ptr += 4;  // vmovdqu YMMWORD PTR [rdi + offset], ymm15
-            offset += 32;
-            shuffles_ptr++;
+            if (errno == EINTR) continue;
+            perror("io_uring_enter");
+            exit(1);
         }
-        else if (c == 2)
+        submitted += n;
+        for (unsigned head = *uring.cq_head; head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE); head++, reaped++)
         {
-            *opcode_ptr++ = 0xC4; *opcode_ptr++ = 0x41; *opcode_ptr++ = 0x35; *opcode_ptr++ = 0xD4; *opcode_ptr++ = 0xCA; // vpaddq ymm9, ymm9, ymm10
-            *opcode_ptr++ = 0xC4; *opcode_ptr++ = 0x41; *opcode_ptr++ = 0x35; *opcode_ptr++ = 0xDE; *opcode_ptr++ = 0xCC; // vpmaxub ymm9, ymm9, ymm12
-            *opcode_ptr++ = 0xC4; *opcode_ptr++ = 0x41; *opcode_ptr++ = 0x35; *opcode_ptr++ = 0xF8; *opcode_ptr++ = 0xEB; // vpsubb ymm13, ymm9, ymm11
+            const struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+            results[(unsigned)cqe->user_data - first] = cqe->res;
+            __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
         }
-        else offset += c;
     }
-    *opcode_ptr++ = 0x48; *opcode_ptr++ = 0x81; *opcode_ptr++ = 0xC7; memcpy(opcode_ptr, &offset, 4); opcode_ptr += 4; // add rdi, offset
-    *opcode_ptr++ = 0xFF; *opcode_ptr++ = 0xCE; // dec esi
-    *opcode_ptr++ = 0x0F; *opcode_ptr++ = 0x85; // |
-    rip_distance = opcode - (opcode_ptr + 4);   // |
-    memcpy(opcode_ptr, &rip_distance, 4);       // |          
-    opcode_ptr += 4;                            // | = jnz opcode
-    *opcode_ptr++ = 0xC3; // ret
 }
  
-void fill_shuffles(int from, int to)
+#define TRACE_THREADS 4098 // the workers, the writer and main
+const char* TRACE_NAMES[] = { "kernel", "write_lines", "write", "wait for a free slot", "wait for a chunk", "wait for the reader", "wait for work", "setup" };
+
+const char* trace_path = NULL; // FIZZBUZZ_TRACE, tracing is off without it
+trace_struct* traces[TRACE_THREADS];
+_Atomic int trace_count = 0;
+uint64_t trace_tsc;
+struct timespec trace_time; // taken together with trace_tsc, to convert ticks into time at the end
+
+void trace_thread(const char* name, int index) // call first thing in every thread that records events
+{
+    if (!trace_path) return;
+    trace_local = calloc(1, sizeof(trace_struct));
+    snprintf(trace_local->name, sizeof(trace_local->name), name, index);
+    traces[atomic_fetch_add(&trace_count, 1)] = trace_local;
+}
+
+void trace_dump() // at exit: the events as a Chrome trace (chrome://tracing, Perfetto) and the share of every phase per thread on stderr
 {
-    for (int i = from; i < to; i += 32)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double ns = (now.tv_sec - trace_time.tv_sec) * 1e9 + (now.tv_nsec - trace_time.tv_nsec), ticks_per_us = (__rdtsc() - trace_tsc) / ns * 1000;
+    FILE* f = fopen(trace_path, "w");
+    if (!f)
     {
-        int boundary = to < i + 32 ? to : i + 32;
-        for (int j = i; j < boundary; j++)
+        perror(trace_path);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    const int count = atomic_load(&trace_count);
+    for (int i = 0; i < count; i++)
+    {
+        const trace_struct* trace = traces[i];
+        fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s\"}},\n", i, trace->name);
+        for (uint64_t e = trace->count > TRACE_EVENTS ? trace->count - TRACE_EVENTS : 0; e < trace->count; e++)
         {
-            int temp_idx = (j - i);
-            __m256i temp_xmm;
-            int8_t val = string[j] < 10 ? string[j] : ((int8_t)((int8_t)-1 * (int8_t)string[j]));
-            if (temp_idx < 16) temp_xmm = _mm256_set_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, val);
-            else
-            {
-                temp_xmm = _mm256_set_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, val, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-                temp_idx -= 16;
-            }
-            for (int k = 0; k < temp_idx; k++) temp_xmm = _mm256_bslli_epi128(temp_xmm, 1);
-            shuffles[shuffle_idx] = _mm256_or_si256(shuffles[shuffle_idx], temp_xmm);
+            const trace_event* event = &trace->events[e % TRACE_EVENTS];
+            fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n", TRACE_NAMES[event->phase], i, (int64_t)(event->begin - trace_tsc) / ticks_per_us, (event->end - event->begin) / ticks_per_us);
         }
-        *bytecode_ptr++ = 1;
-        if (boundary != i + 32) *bytecode_ptr++ = to - (i + 32);
-        shuffle_idx++;
     }
-    *bytecode_ptr++ = 2;
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"FizzBuzz\"}}\n], \"otherData\": {");
+    fprintf(stderr, "trace (%s, %.0f MHz tsc):\n", trace_path, ticks_per_us);
+    for (int i = 0; i < count; i++)
+    {
+        const trace_struct* trace = traces[i];
+        const uint64_t total = trace->last - trace->first;
+        uint64_t traced = 0;
+        fprintf(stderr, "  %-10s %10.3f ms:", trace->name, total / ticks_per_us / 1000);
+        fprintf(f, "%s\"%s\": \"", i ? ", " : "", trace->name);
+        for (int phase = 0; phase < TRACE_PHASES; phase++)
+        {
+            traced += trace->cycles[phase];
+            if (!trace->cycles[phase]) continue;
+            fprintf(stderr, " %s %.1f%%", TRACE_NAMES[phase], 100.0 * trace->cycles[phase] / (total ? total : 1));
+            fprintf(f, "%s %.1f%%, ", TRACE_NAMES[phase], 100.0 * trace->cycles[phase] / (total ? total : 1));
+        }
+        fprintf(stderr, " other %.1f%%\n", total ? 100.0 * (total - traced) / total : 0.0);
+        fprintf(f, "other %.1f%%\"", total ? 100.0 * (total - traced) / total : 0.0);
+    }
+    fprintf(f, "}}\n");
+    fclose(f);
 }
  
+#define HUGE_PAGE (2 << 20)
+int huge_pages = 1; // --small-pages turns it off
+int print_stats = 0;
+ 
 typedef struct {
-    char* thread_buffer;
+    const char* name;
+    size_t bytes;
+    size_t huge_bytes; // backed by 2 MB pages after prefaulting
+    int hugetlb; // from the reserved pool rather than THP
+} page_report_struct;
+ 
+page_report_struct page_reports[4];
+int page_report_count = 0;
+ 
+size_t thp_bytes(void* address) // AnonHugePages of the mapping holding address, there is no other way to ask
+{
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) return 0;
+    char line[256];
+    int inside = 0;
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) inside = start <= (unsigned long)address && (unsigned long)address < end;
+        else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+ 
+void report_pages(const char* name, size_t bytes, size_t huge_bytes, int hugetlb)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // workers allocate their own buffers
+    pthread_mutex_lock(&lock);
+    page_report_struct* report = page_reports;
+    while (report < page_reports + page_report_count && strcmp(report->name, name)) report++;
+    if (report == page_reports + page_report_count) *report = (page_report_struct){ name, 0, 0, 0 }, page_report_count++;
+    report->bytes += bytes;
+    report->huge_bytes += huge_bytes < bytes ? huge_bytes : bytes; // neighbouring buffers can share one mapping, so THP numbers are only an estimate
+    report->hugetlb |= hugetlb;
+    pthread_mutex_unlock(&lock);
+}
+ 
+void* alloc_pages(const char* name, size_t bytes, int prot, int flags) // prefaulted, on 2 MB pages if we can get them: MAP_HUGETLB if huge pages are reserved, THP otherwise; MAP_FAILED like mmap
+{
+    uint8_t* p = huge_pages ? mmap(NULL, (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1), prot, flags | MAP_PRIVATE | MAP_ANON | MAP_HUGETLB | MAP_POPULATE, -1, 0) : MAP_FAILED;
+    if (p != MAP_FAILED)
+    {
+        report_pages(name, bytes, bytes, 1);
+        return p;
+    }
+    const size_t slack = huge_pages ? HUGE_PAGE : 0, page_bytes = (bytes + 4095) & ~(size_t)4095; // THP only covers 2 MB aligned ranges
+    uint8_t* mapping = mmap(NULL, page_bytes + slack, prot, flags | MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mapping == MAP_FAILED) return MAP_FAILED;
+    p = slack ? (uint8_t*)(((uintptr_t)mapping + slack - 1) & ~(uintptr_t)(slack - 1)) : mapping;
+    if (p > mapping) munmap(mapping, p - mapping);
+    if (mapping + slack > p) munmap(p + page_bytes, mapping + slack - p);
+    if (huge_pages) madvise(p, page_bytes, MADV_HUGEPAGE);
+    for (size_t i = 0; i < bytes; i += 4096) p[i] = 0; // fault everything in now rather than in the middle of a run, on the node of whoever calls this
+    report_pages(name, bytes, huge_pages && print_stats ? thp_bytes(p) : 0, 0); // smaps is slow to read, only --stats shows it
+    return p;
+}
+ 
+typedef struct {
+    _Atomic uint32_t count; // only ever goes up, the waiter knows which value it needs
+    _Atomic uint32_t sleepers;
+} handoff_struct;
+ 
+#define HANDOFF_SPINS 128 // a few microseconds of pause before we give up the core
+
+int handoff_reached(handoff_struct* handoff, uint32_t target)
+{
+    return (int32_t)(atomic_load(&handoff->count) - target) >= 0;
+}
+ 
+void handoff_post(handoff_struct* handoff)
+{
+    atomic_fetch_add(&handoff->count, 1);
+    if (atomic_load(&handoff->sleepers)) syscall(SYS_futex, &handoff->count, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+ 
+int handoff_wait(handoff_struct* handoff, uint32_t target) // returns whether it had to wait at all
+{
+    if (handoff_reached(handoff, target)) return 0;
+    for (int i = 0; i < HANDOFF_SPINS; i++)
+    {
+        _mm_pause();
+        if (handoff_reached(handoff, target)) return 1;
+    }
+    atomic_fetch_add(&handoff->sleepers, 1); // seq_cst on both sides, so either the poster sees us or we see its count
+    uint32_t count;
+    while ((int32_t)((count = atomic_load(&handoff->count)) - target) < 0) syscall(SYS_futex, &handoff->count, FUTEX_WAIT_PRIVATE, count, NULL, NULL, 0);
+    atomic_fetch_sub(&handoff->sleepers, 1);
+    return 1;
+}
+ 
+typedef struct {
+    char* buffer;
     int buffer_len;
-    int start_number;
-    int end_number;
-    int runs;
+    int pending; // pushed, but the pipe may still reference it
+    uint64_t release;
+    handoff_struct filled; // posted by the worker once per fill
+    handoff_struct released; // posted by the writer once the pipe is done with it
+    uint32_t fills; // owned by the worker
+    uint32_t pushes; // owned by the writer
+} slot_struct;
+ 
+int ring_depth = 2; // buffers per worker
+int nt_stores = -1; // -1: streaming stores when the output won't be read from the cache anyway
+uint64_t writer_waits = 0; // the writer found the next slot still being filled
+ 
+typedef struct {
+    slot_struct* slots;
+    int next_fill; // the worker's position in its ring, next_push is the writer's
+    int next_push;
     int thread;
-    pthread_spinlock_t work;
-    pthread_mutex_t idle;
-    __m256i number;
-    char pad[86];
+    uint64_t stalls; // the worker found its next slot still waiting to be written
+    handoff_struct work; // posted once the job list is ready
+    handoff_struct done; // posted once the worker went through all of its chunks
+    handoff_struct ready; // posted once it's pinned and its buffers are faulted in
+    int cpu; // -1: not pinned
+    int node;
+    uint64_t bytes; // generated, for the per node throughput
+    char pad[64];
 } arguments_struct;
  
-#define MAX_DIGITS 10
-#define BUFFER_SIZE (LINES_PER_THREAD / 300 * STRING_LEN + 1024)
-
-void* thread_func(void* void_arguments)
+uint64_t chunk_lines; // lines per chunk, before its first line is moved onto the block grid
+uint64_t chunk_count; // chunk c is generated by worker c % num_threads
+size_t buffer_bytes; // of every slot, the workers allocate their own
+int file_mode = 0; // the workers pwrite their chunks straight into the output file, there is no writer
+uint64_t chunk_offset(uint64_t from); // from the seek layer
+ 
+uint64_t chunk_first(uint64_t chunk) // chunk_lines apart, moved forward onto the block grid of their width unless that leaves the width or the range
+{
+    if (chunk == 0) return start_line;
+    const int period = generator->period;
+    const uint64_t line = start_line + chunk * chunk_lines;
+    const int width = decimal_width(line);
+    if (width < 3 || !period) return line;
+    const uint64_t offset = (line - POW10[width - 1]) % period, limit = last_of_width(width) < end_line ? last_of_width(width) : end_line;
+    if (!offset || period - offset > limit - line) return line;
+    return line + (period - offset); // less than a period, so the next chunk still starts after it
+}
+ 
+void* thread_func(void* void_arguments) // goes through its chunks without waiting for the writer, only a full ring holds it back
 {
     arguments_struct* ref_arguments = (arguments_struct*)void_arguments;
-    while(1)
+    if (ref_arguments->cpu >= 0)
+    {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(ref_arguments->cpu, &cpu);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+    }
+    trace_thread("worker %d", ref_arguments->thread);
+    uint64_t trace = trace_begin();
+    for (int i = 0; i < (file_mode ? !out_map : ring_depth); i++) ref_arguments->slots[i].buffer = alloc_pages("output buffers", buffer_bytes, PROT_READ | PROT_WRITE, 0); // page aligned so whole pages can be spliced; pwrite only uses slots[0], mmap none
+    trace_end(TRACE_SETUP, trace);
+    handoff_post(&ref_arguments->ready);
+    uint64_t flushed_begin = 0, flushed_end = 0;
+    trace = trace_begin();
+    handoff_wait(&ref_arguments->work, 1);
+    trace_end(TRACE_WAIT_WORK, trace);
+    for (uint64_t chunk = ref_arguments->thread; chunk < chunk_count; chunk += num_threads)
     {
-        while (pthread_spin_trylock(&ref_arguments->work)) continue;
-        arguments_struct arguments = *ref_arguments;
-        const int start_number = arguments.start_number;
-        arguments.number = _mm256_set_epi8(246, 246, 246, 246, 246, 246, 246, 246, 246, (start_number % 1000000000 / 100000000) + 246, (start_number % 100000000 / 10000000) + 246, (start_number % 10000000 / 1000000) + 246, (start_number % 1000000 / 100000) + 246, (start_number % 100000 / 10000) + 246, (start_number % 10000 / 1000) + 246, (start_number % 1000 / 100) + 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, (start_number % 1000000000 / 100000000) + 246, (start_number % 100000000 / 10000000) + 246, (start_number % 10000000 / 1000000) + 246, (start_number % 1000000 / 100000) + 246, (start_number % 100000 / 10000) + 246, (start_number % 10000 / 1000) + 246, (start_number % 1000 / 100) + 246);
-        asm("vmovdqa %0, %%ymm10\n\t"
-                "vmovdqa %1, %%ymm11\n\t"
-                "vmovdqa %2, %%ymm12\n\t"
-                "vmovdqa %3, %%ymm9\n\t"
-                "vpsubb %%ymm11, %%ymm9, %%ymm13\n\t"
-                :
-            : "" (ONE),
-                "" (VEC_198),
-                "" (VEC_246),
-                "" (arguments.number));
-        opcode_exec(arguments.thread_buffer, arguments.runs);
-        pthread_mutex_unlock(&ref_arguments->idle);
+        if (file_mode) // the offset of every chunk is known, so no ordering is needed and one buffer is enough
+        {
+            const uint64_t from = chunk_first(chunk), to = chunk + 1 == chunk_count ? end_line : chunk_first(chunk + 1) - 1, offset = chunk_offset(from);
+            if (!out_map)
+            {
+                char* buffer = ref_arguments->slots[0].buffer + offset % DIRECT_ALIGN;
+                const size_t len = generate_range(generator, buffer, from, to) - buffer;
+                trace = trace_begin();
+                output_pwrite(buffer, len, offset);
+                trace_end(TRACE_WRITE, trace);
+                ref_arguments->bytes += len;
+                continue;
+            }
+            char* dst = out_map + (offset - map_offset);
+            const size_t len = generate_range(generator, dst, from, to) - dst; // nothing lands past the chunk, so it goes right into the mapping
+            ref_arguments->bytes += len;
+            if (mmap_flush) // keeps about two chunks per worker dirty: this one starts writing back, the one before is waited for and dropped
+            {
+                trace = trace_begin();
+                output_flush(offset, dst + len - out_map + map_offset, 0);
+                output_flush(flushed_begin, flushed_end, 1);
+                trace_end(TRACE_WRITE, trace);
+                flushed_begin = offset;
+                flushed_end = dst + len - out_map + map_offset;
+            }
+            continue;
+        }
+        slot_struct* slot = &ref_arguments->slots[ref_arguments->next_fill];
+        trace = trace_begin();
+        if (handoff_wait(&slot->released, slot->fills))
+        {
+            ref_arguments->stalls++;
+            trace_end(TRACE_WAIT_SLOT, trace);
+        }
+        const uint64_t from = chunk_first(chunk), to = chunk + 1 == chunk_count ? end_line : chunk_first(chunk + 1) - 1;
+        slot->buffer_len = generate_range(generator, slot->buffer, from, to) - slot->buffer;
+        ref_arguments->bytes += slot->buffer_len;
+        ref_arguments->next_fill = (ref_arguments->next_fill + 1) % ring_depth;
+        slot->fills++;
+        handoff_post(&slot->filled);
     }
-    pthread_exit(NULL);
+    handoff_post(&ref_arguments->done);
+    return NULL;
+}
+ 
+int release_slot(slot_struct* slot, uint64_t consumed) // consumed: from output_consumed(), returns whether the slot is still pending
+{
+    if (!slot->pending || consumed < slot->release) return slot->pending;
+    slot->pending = 0;
+    handoff_post(&slot->released);
+    return 0;
 }
  
-const char FIRST_100_LINES[] = "1\n2\nFizz\n4\nBuzz\nFizz\n7\n8\nFizz\nBuzz\n11\nFizz\n13\n14\nFizzBuzz\n16\n17\nFizz\n19\nBuzz\nFizz\n22\n23\nFizz\nBuzz\n26\nFizz\n28\n29\nFizzBuzz\n31\n32\nFizz\n34\nBuzz\nFizz\n37\n38\nFizz\nBuzz\n41\nFizz\n43\n44\nFizzBuzz\n46\n47\nFizz\n49\nBuzz\nFizz\n52\n53\nFizz\nBuzz\n56\nFizz\n58\n59\nFizzBuzz\n61\n62\nFizz\n64\nBuzz\nFizz\n67\n68\nFizz\nBuzz\n71\nFizz\n73\n74\nFizzBuzz\n76\n77\nFizz\n79\nBuzz\nFizz\n82\n83\nFizz\nBuzz\n86\nFizz\n88\n89\nFizzBuzz\n91\n92\nFizz\n94\nBuzz\nFizz\n97\n98\nFizz\n";
+enum { AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER, AFFINITY_LIST };
+int affinity = AFFINITY_NONE;
+int affinity_cpus[CPU_SETSIZE], affinity_cpu_count = 0; // worker i runs on affinity_cpus[i % affinity_cpu_count]
+int cpu_node[CPU_SETSIZE], node_count = 1;
+int writer_node = -1; // -1: the node of the output's block device, if there is one
  
-int main()
+int parse_cpu_list(const char* list, int* cpus) // "0-3,8,10-11" as in sysfs and taskset -c, returns the count or -1
 {
-    pthread_t threads[NUM_THREADS];
-    alignas(256) arguments_struct thread_args[NUM_THREADS];
-    for (int i = 0; i < NUM_THREADS; i++)
+    int count = 0;
+    for (const char* p = list; *p; )
     {
-        thread_args[i].thread = i;
-        pthread_spin_init(&thread_args[i].work, PTHREAD_PROCESS_PRIVATE);
-        pthread_spin_lock(&thread_args[i].work);
-        pthread_mutex_init(&thread_args[i].idle, NULL);
-        pthread_mutex_lock(&thread_args[i].idle);
-        thread_args[i].thread_buffer = malloc((LINES_PER_THREAD / 300) * (940 + (160 * 9)) + 1024);
-    }
-    set_constants();
-    opcode = (uint8_t*)mmap(NULL, 10000, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANON | MAP_32BIT, -1, 0);
-    fwrite(FIRST_100_LINES, 1, sizeof(FIRST_100_LINES), stdout);
-    uint64_t line_number = 100, line_boundary = 1000;
-    for (int thread = 0; thread < NUM_THREADS; thread++) pthread_create(&threads[thread], NULL, thread_func, (void*)(&thread_args[thread]));
-    for (digits = 3; digits < MAX_DIGITS; digits++)
-    {
-        const int STRING_LEN = 940 + (160 * digits);
-        for (int i = 0; i < 500; i++) shuffles[i] = _mm256_setzero_si256();
-        string_ptr = string;
-        uint8_t shuffle_init[] = { 8, 7, 6, 5, 4, 3, 2, 1, 0, '0', '0', '\n' }, * shuffle_init_ptr = shuffle_init + 11 - digits;
-        for (int i = 100; i < 400; i += 10)
-        {
-            for (int j = i; j < i + 10; j++)
+        char* end;
+        const long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (last < first || last >= CPU_SETSIZE || (*end && *end != ',' && *end != '\n')) return -1;
+        for (long cpu = first; cpu <= last && count < CPU_SETSIZE; cpu++) cpus[count++] = cpu;
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+ 
+void read_topology() // no libnuma, sysfs has everything; without it every CPU counts as node 0
+{
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) cpu_node[cpu] = 0;
+    char list[4096];
+    int nodes[1024], node_total = -1; // node numbers can have holes, probing all 1024 of them took milliseconds
+    FILE* online = fopen("/sys/devices/system/node/online", "r");
+    if (online)
+    {
+        if (fgets(list, sizeof(list), online)) node_total = parse_cpu_list(list, nodes); // same format as a cpulist
+        fclose(online);
+    }
+    for (int n = 0; n < node_total; n++)
+    {
+        const int node = nodes[n];
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (!f) continue;
+        int cpus[CPU_SETSIZE], count = fgets(list, sizeof(list), f) ? parse_cpu_list(list, cpus) : -1;
+        fclose(f);
+        for (int i = 0; i < count; i++) cpu_node[cpus[i]] = node;
+        node_count = node + 1;
+    }
+}
+ 
+void setup_affinity(const char* list)
+{
+    read_topology();
+    if (affinity == AFFINITY_NONE) return;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+    if (affinity == AFFINITY_LIST)
+    {
+        if ((affinity_cpu_count = parse_cpu_list(list, affinity_cpus)) <= 0) 
+        {
+            fprintf(stderr, "invalid value for --affinity: '%s' (expected compact, scatter or a CPU list like 0-3,8)\n", list);
+            exit(1);
+        }
+        for (int i = 0; i < affinity_cpu_count; i++) if (!CPU_ISSET(affinity_cpus[i], &allowed))
+        {
+            fprintf(stderr, "CPU %d is not in the affinity mask\n", affinity_cpus[i]);
+            exit(1);
+        }
+        return;
+    }
+    for (int node = 0; node < node_count; node++) for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &allowed) && cpu_node[cpu] == node) affinity_cpus[affinity_cpu_count++] = cpu; // compact: fill one node before the next
+    if (affinity == AFFINITY_SCATTER) // one CPU of every node in turn
+    {
+        int by_node[CPU_SETSIZE], taken[1024] = { 0 }, count = 0;
+        while (count < affinity_cpu_count) for (int node = 0; node < node_count; node++)
+        {
+            int seen = 0;
+            for (int i = 0; i < affinity_cpu_count; i++) if (cpu_node[affinity_cpus[i]] == node && seen++ == taken[node])
             {
-                if (j % 3 == 0)
-                {
-                    if (j % 5 == 0)
-                    {
-                        memcpy(string_ptr, FizzBuzz, 9);
-                        string_ptr += 9;
-                    }
-                    else
-                    {
-                        memcpy(string_ptr, Fizz, 5);
-                        string_ptr += 5;
-                    }
-                }
-                else if (j % 5 == 0)
-                {
-                    memcpy(string_ptr, Buzz, 5);
-                    string_ptr += 5;
-                }
-                else
-                {
-                    memcpy(string_ptr, shuffle_init_ptr, digits + 1);
-                    string_ptr += digits + 1;
-                }
-                if (shuffle_init[10] == '9') shuffle_init[10] = '0';
-                else shuffle_init[10]++;
+                by_node[count++] = affinity_cpus[i];
+                taken[node]++;
+                break;
             }
-            if (shuffle_init[9] == '9') shuffle_init[9] = '0';
-            else shuffle_init[9]++;
-        }
-        bytecode_ptr = bytecode;
-        shuffle_idx = 0;
-        const int FIRST_BOUNDARY = 312 + (54 * digits), SECOND_BOUNDARY = 624 + (107 * digits), THIRD_BOUNDARY = 940 + (160 * digits);
-        fill_shuffles(0, FIRST_BOUNDARY);
-        fill_shuffles(FIRST_BOUNDARY, SECOND_BOUNDARY);
-        fill_shuffles(SECOND_BOUNDARY, THIRD_BOUNDARY);
-        CODE_SIZE = bytecode_ptr - bytecode;
-        generate_opcode();
-        opcode_exec = opcode;
-        const int runs_to_buffer = (BUFFER_SIZE / STRING_LEN), runs_to_digit = (line_boundary - line_number) / 300;
-        int runs_per_thread = (runs_to_digit < runs_to_buffer ? runs_to_digit : runs_to_buffer) / NUM_THREADS;
-        int THREADS_TO_DO = NUM_THREADS;
-        if (runs_per_thread == 0)
-        {
-            runs_per_thread = runs_to_digit;
-            THREADS_TO_DO = 1;
-        }
-        int temp_line_number = line_number;
-        for (int thread = 0; thread < THREADS_TO_DO; thread++)
-        {
-            thread_args[thread].start_number = temp_line_number;
-            thread_args[thread].end_number = temp_line_number + (runs_per_thread * 300);
-            thread_args[thread].runs = runs_per_thread;
-            thread_args[thread].buffer_len = runs_per_thread * STRING_LEN;
-            temp_line_number += runs_per_thread * 300;
-        }
-        for (int thread = 0; thread < THREADS_TO_DO; thread++) pthread_spin_unlock(&thread_args[thread].work);
-        while(line_number < line_boundary)
-        {
-            for (int thread = 0; thread < THREADS_TO_DO; thread++) 
+        }
+        memcpy(affinity_cpus, by_node, count * sizeof(int));
+    }
+}
+ 
+int worker_cpu(int thread) // -1 leaves it to the scheduler
+{
+    return affinity == AFFINITY_NONE || !affinity_cpu_count ? -1 : affinity_cpus[thread % affinity_cpu_count];
+}
+ 
+int output_node() // the NUMA node of the disk a regular file lives on, -1 if unknown (pipes, sockets... need --writer-node)
+{
+    struct stat st;
+    if (fstat(out_fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) return -1;
+    const dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    const char* paths[] = { "/sys/dev/block/%u:%u/device/numa_node", "/sys/dev/block/%u:%u/../device/numa_node" }; // a partition's device is its disk's
+    for (int i = 0; i < 2; i++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), paths[i], major(dev), minor(dev));
+        FILE* f = fopen(path, "r");
+        if (!f) continue;
+        int node = -1;
+        if (fscanf(f, "%d", &node) != 1) node = -1;
+        fclose(f);
+        return node;
+    }
+    return -1;
+}
+ 
+void pin_writer() // after the workers are created, so unpinned ones keep the whole mask
+{
+    const int node = writer_node >= 0 ? writer_node : output_node();
+    if (node < 0) return;
+    cpu_set_t allowed, cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &allowed) && cpu_node[cpu] == node) CPU_SET(cpu, &cpus);
+    if (CPU_COUNT(&cpus)) sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+ 
+int byte_slice = 0; // print only bytes [slice_from, slice_to) of the output, or shard shard_index of shard_count
+uint128_t slice_from, slice_to;
+uint64_t shard_index, shard_count = 0;
+uint128_t start_bytes; // bytes_upto(start_line - 1), set before the workers start
+ 
+uint64_t chunk_offset(uint64_t from)
+{
+    return file_base + (uint64_t)(bytes_upto(generator, from - 1) - start_bytes);
+}
+ 
+int cut_slice(char* tail, int* tail_len) // prints the partial first line of the slice, leaves the partial last one in tail and the whole lines in between in [start_line, end_line], 0 if there are none
+{
+    const uint128_t base = bytes_upto(generator, start_line - 1), total = bytes_upto(generator, end_line) - base;
+    if (shard_count) // byte balanced, so the shards only split lines at their ends
+    {
+        slice_from = total * shard_index / shard_count;
+        slice_to = total * (shard_index + 1) / shard_count;
+    }
+    if (!shard_count && slice_from >= total && slice_to > slice_from) // an empty range is fine anywhere, bytes that don't exist aren't
+    {
+        fprintf(stderr, "--byte-range starts past the last byte of lines %" PRIu64 "..%" PRIu64 "\n", start_line, end_line);
+        exit(1);
+    }
+    if (slice_to > total) slice_to = total;
+    if (slice_from >= slice_to) return 0;
+    uint64_t first = line_at(generator, base, slice_from, start_line, end_line), last = line_at(generator, base, slice_to - 1, start_line, end_line);
+    const int skip = slice_from - (bytes_upto(generator, first - 1) - base), keep = slice_to - (bytes_upto(generator, last - 1) - base);
+    char line[MAX_WORDS + 32];
+    if (first == last)
+    {
+        write_line(generator, line, first);
+        output_write(line + skip, keep - skip);
+        return 0;
+    }
+    if (skip)
+    {
+        const int len = write_line(generator, line, first) - line;
+        output_write(line + skip, len - skip);
+        first++;
+    }
+    if (keep < write_line(generator, tail, last) - tail)
+    {
+        *tail_len = keep;
+        last--;
+    }
+    start_line = first;
+    end_line = last;
+    return first <= last;
+}
+ 
+void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [--start=N] [--end=N] [--rules=D:WORD,...] [--threads=N] [--lines-per-thread=N] [--engine=E] [--unroll=N] [--nt-stores=auto|on|off] [--ring-depth=N] [--stats] [--byte-range=A-B | --shard=I/N] [--output=FILE [--direct | --mmap [--mmap-flush] [--mmap-huge]]] [--io-uring] [--vmsplice] [--small-pages] [--affinity=P] [--writer-node=N] [--calibrate[=stdout]]\n"
+                    "  --start=N, --end=N    first and last line to print, 1 <= N <= 2^64 - 1 (default 1 and 1000000000)\n"
+                    "  --rules=D:WORD,...    divisors and their words, in output order (default 3:Fizz,5:Buzz)\n"
+                    "  --threads=N           worker threads (env FIZZBUZZ_THREADS, default: CPUs in the affinity mask)\n"
+                    "  --lines-per-thread=N  lines per round of chunks, split into one chunk of N / threads lines per worker, rounded down to a\n"
+                    "                        multiple of the period (env FIZZBUZZ_LINES_PER_THREAD, default 450000)\n"
+                    "  --engine=E            avx512, avx2, sse41 or scalar (default: the fastest one the CPU supports)\n"
+                    "  --unroll=N            blocks the avx2 and avx512 kernels generate per loop iteration, 1..4 (env FIZZBUZZ_UNROLL, default 1)\n"
+                    "  --nt-stores=S         write the output with non-temporal stores through a small staging buffer: on, off or auto, for mmap and O_DIRECT\n"
+                    "                        output and buffers larger than the last level cache (env FIZZBUZZ_NT_STORES, default auto)\n"
+                    "  --ring-depth=N        output buffers per worker, so it can keep generating while earlier ones drain (env FIZZBUZZ_RING_DEPTH, default 2)\n"
+                    "  --stats               print how often workers and the writer had to wait on each other to stderr\n"
+                    "  --byte-range=A-B      print only bytes A (inclusive) to B (exclusive) of the output, counted from 0; B past the end is cut to it, A past it is an error\n"
+                    "  --shard=I/N           print only the I-th of N byte balanced slices, 0 <= I < N, the N slices concatenate to the whole output\n"
+                    "  --output=FILE         write to FILE instead of stdout, regular files are written by all workers in parallel\n"
+                    "  --direct              write whole pages of a regular file with O_DIRECT, bypassing the page cache\n"
+                    "  --mmap                map a regular output file and let the kernels store straight into it\n"
+                    "  --mmap-flush          with --mmap, write back and drop each worker's finished chunks as it goes, to bound dirty memory\n"
+                    "  --mmap-huge           with --mmap, ask for huge pages (only files on tmpfs mounted with huge= get them)\n"
+                    "  --io-uring            write to pipes, sockets and appended files through io_uring, one linked batch of buffers per syscall\n"
+                    "  --vmsplice            move the buffers' pages into the output pipe instead of copying them; only for readers that read(2) the\n"
+                    "                        pipe (cat, Verify...), one that splices them on (pv, tee) can see them overwritten\n"
+                    "  --small-pages         don't ask for 2 MB pages for the buffers, masks and kernel code (--stats shows what we got)\n"
+                    "  --affinity=P          pin workers: compact (fill a NUMA node first), scatter (round robin over nodes), a CPU list like 0-3,8 or none (env FIZZBUZZ_AFFINITY, default none)\n"
+                    "  --writer-node=N       run the writer on node N, near the NIC (default: the node of the output file's disk, if known)\n"
+                    "  --calibrate           try chunk sizes, thread counts, ring depths and store strategies and save the fastest as this\n"
+                    "                        host's profile, which later runs start from (env FIZZBUZZ_PROFILE=FILE, default\n"
+                    "                        ~/.cache/fizzbuzz/profiles, empty: no profile). The runs go into a pipe we drain, or --output=FILE\n"
+                    "  --calibrate=stdout    the same on the real stdout, whose reader gets about 30 runs of 0.9 GB each\n"
+                    "env FIZZBUZZ_TRACE=FILE records what every thread spends its time on and writes it to FILE as a Chrome trace at exit\n", name);
+    exit(1);
+}
+ 
+long parse_number(const char* name, const char* value, long min, long max)
+{
+    char* end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (errno || end == value || *end || n < min || n > max)
+    {
+        fprintf(stderr, "invalid value for %s: '%s' (expected %ld..%ld)\n", name, value, min, max);
+        exit(1);
+    }
+    return n;
+}
+ 
+int parse_switch(const char* name, const char* value) // on 1, off 0, auto -1
+{
+    if (!strcmp(value, "on") || !strcmp(value, "off") || !strcmp(value, "auto")) return value[1] == 'n' ? 1 : value[1] == 'f' ? 0 : -1;
+    fprintf(stderr, "invalid value for %s: '%s' (expected on, off or auto)\n", name, value);
+    exit(1);
+}
+ 
+uint128_t parse_offset(const char* name, const char* value, const char** end) // strtoull can't go past 2^64, the whole output can
+{
+    uint128_t n = 0;
+    const char* p = value;
+    for (; *p >= '0' && *p <= '9' && n < ((uint128_t)1 << 100); p++) n = n * 10 + (*p - '0');
+    if (p == value || (*p >= '0' && *p <= '9'))
+    {
+        fprintf(stderr, "invalid value for %s: '%s'\n", name, value);
+        exit(1);
+    }
+    *end = p;
+    return n;
+}
+ 
+uint64_t parse_line(const char* name, const char* value)
+{
+    char* end;
+    errno = 0;
+    uint64_t n = strtoull(value, &end, 10);
+    if (errno || end == value || *end || *value == '-' || n == 0)
+    {
+        fprintf(stderr, "invalid value for %s: '%s' (expected 1..18446744073709551615)\n", name, value);
+        exit(1);
+    }
+    return n;
+}
+ 
+void parse_rules(const char* value)
+{
+    rule_count = 0;
+    for (const char* p = value; *p; )
+    {
+        char* end;
+        errno = 0;
+        const uint64_t divisor = strtoull(p, &end, 10);
+        const char* word_end = end + strcspn(end, ",");
+        if (errno || end == p || *p == '-' || divisor == 0 || *end != ':' || word_end == end + 1 || rule_count == 16 || word_end - end > 256)
+        {
+            fprintf(stderr, "invalid value for --rules: '%s' (expected up to 16 DIVISOR:WORD pairs separated by commas)\n", value);
+            exit(1);
+        }
+        rules[rule_count].divisor = divisor;
+        rules[rule_count].word = strndup(end + 1, word_end - end - 1);
+        rules[rule_count].len = word_end - end - 1;
+        rule_count++;
+        p = *word_end ? word_end + 1 : word_end;
+    }
+}
+ 
+// --calibrate finds the fastest settings for this host and output, and writes them to a profile file that every later run
+// starts from. The file holds one line per host: CPU model, CPUs in the affinity mask, threads, lines per thread, ring depth, non-temporal
+// stores and io_uring, tab separated, so hosts sharing a home directory keep their own.
+ 
+typedef struct {
+    int threads, lines_per_thread, ring_depth, nt_stores, io_uring;
+} profile_struct;
+ 
+int calibrate = 0; // 1: the runs go into a pipe we drain (or --output), 2: into our stdout
+ 
+const char* profile_path() // NULL if profiles are turned off
+{
+    static char path[4096];
+    const char* env = getenv("FIZZBUZZ_PROFILE");
+    if (env) return *env ? env : NULL;
+    const char* home = getenv("HOME");
+    if (!home) return NULL;
+    snprintf(path, sizeof(path), "%s/.cache/fizzbuzz/profiles", home);
+    return path;
+}
+ 
+void profile_key(char* key, size_t size) // "model name\tCPUs", counted like the default thread count, so a cpuset or cgroup gets its own profile
+{
+    char line[512], model[256] = "unknown";
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    while (f && fgets(line, sizeof(line), f))
+    {
+        char* colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) || !colon) continue;
+        snprintf(model, sizeof(model), "%s", colon + 2);
+        model[strcspn(model, "\n\t")] = 0;
+        break;
+    }
+    if (f) fclose(f);
+    cpu_set_t cpus;
+    snprintf(key, size, "%s\t%ld", model, sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? (long)CPU_COUNT(&cpus) : sysconf(_SC_NPROCESSORS_ONLN));
+}
+ 
+int load_profile(profile_struct* profile) // 0 if there is none for this host
+{
+    const char* path = profile_path();
+    FILE* f = path ? fopen(path, "r") : NULL;
+    if (!f) return 0;
+    char key[300], line[512];
+    profile_key(key, sizeof(key));
+    const size_t key_len = strlen(key);
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f)) found = !strncmp(line, key, key_len) && line[key_len] == '\t' && sscanf(line + key_len + 1, "%d %d %d %d %d", &profile->threads, &profile->lines_per_thread, &profile->ring_depth, &profile->nt_stores, &profile->io_uring) == 5;
+    fclose(f);
+    return found && profile->threads >= 1 && profile->threads <= 4096 && profile->lines_per_thread >= 300 && profile->lines_per_thread <= 1 << 26 && profile->ring_depth >= 1 && profile->ring_depth <= 64;
+}
+ 
+void save_profile(const profile_struct* profile) // replaces this host's line, keeps everyone else's
+{
+    const char* path = profile_path();
+    if (!path) return;
+    char dir[4096], temp[4200], key[300], line[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char* slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) // mkdir -p of everything before the file name
+    {
+        *slash = 0;
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    FILE* out = fopen(temp, "w"), * in = fopen(path, "r");
+    if (!out)
+    {
+        perror(temp);
+        if (in) fclose(in);
+        return;
+    }
+    profile_key(key, sizeof(key));
+    const size_t key_len = strlen(key);
+    while (in && fgets(line, sizeof(line), in)) if (strncmp(line, key, key_len) || line[key_len] != '\t') fputs(line, out);
+    if (in) fclose(in);
+    fprintf(out, "%s\t%d\t%d\t%d\t%d\t%d\n", key, profile->threads, profile->lines_per_thread, profile->ring_depth, profile->nt_stores, profile->io_uring);
+    if (fclose(out) != 0 || rename(temp, path) != 0) perror(path);
+    else fprintf(stderr, "profile written to %s\n", path);
+}
+ 
+void parse_options(int argc, char** argv)
+{
+    cpu_set_t cpus;
+    int engine = -1; // the fastest one the CPU supports unless --engine says otherwise
+    int unroll = 0; // 0: the generator's default
+    num_threads = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : sysconf(_SC_NPROCESSORS_ONLN); // honours taskset and cgroup cpusets
+    if (num_threads < 1) num_threads = 1;
+    for (int i = 1; i < argc; i++) if (!strcmp(argv[i], "--calibrate") || !strcmp(argv[i], "--calibrate=stdout")) calibrate = argv[i][11] ? 2 : 1;
+    profile_struct profile;
+    if (!calibrate && load_profile(&profile)) // the environment and the command line still override it
+    {
+        num_threads = profile.threads;
+        threads_given = 1;
+        lines_per_thread = profile.lines_per_thread;
+        ring_depth = profile.ring_depth;
+        nt_stores = profile.nt_stores;
+        use_uring = profile.io_uring;
+    }
+    const char* env;
+    if ((env = getenv("FIZZBUZZ_THREADS"))) num_threads = parse_number("FIZZBUZZ_THREADS", env, 1, 4096), threads_given = 1;
+    const char* affinity_list = getenv("FIZZBUZZ_AFFINITY");
+    if ((env = getenv("FIZZBUZZ_UNROLL"))) unroll = parse_number("FIZZBUZZ_UNROLL", env, 1, MAX_UNROLL);
+    if ((env = getenv("FIZZBUZZ_NT_STORES"))) nt_stores = parse_switch("FIZZBUZZ_NT_STORES", env);
+    if ((env = getenv("FIZZBUZZ_RING_DEPTH"))) ring_depth = parse_number("FIZZBUZZ_RING_DEPTH", env, 1, 64);
+    if ((env = getenv("FIZZBUZZ_LINES_PER_THREAD"))) lines_per_thread = parse_number("FIZZBUZZ_LINES_PER_THREAD", env, 300, 1 << 26);
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strncmp(argv[i], "--start=", 8)) start_line = parse_line("--start", argv[i] + 8);
+        else if (!strncmp(argv[i], "--end=", 6)) end_line = parse_line("--end", argv[i] + 6);
+        else if (!strncmp(argv[i], "--engine=", 9))
+        {
+            for (engine = ENGINE_COUNT - 1; engine >= 0 && strcmp(argv[i] + 9, ENGINE_NAMES[engine]); engine--);
+            if (engine < 0) usage(argv[0]);
+            if (!engine_supported(engine))
+            {
+                fprintf(stderr, "this CPU doesn't support the %s engine\n", ENGINE_NAMES[engine]);
+                exit(1);
+            }
+        }
+        else if (!strncmp(argv[i], "--rules=", 8)) parse_rules(argv[i] + 8);
+        else if (!strncmp(argv[i], "--unroll=", 9)) unroll = parse_number("--unroll", argv[i] + 9, 1, MAX_UNROLL);
+        else if (!strncmp(argv[i], "--nt-stores=", 12)) nt_stores = parse_switch("--nt-stores", argv[i] + 12);
+        else if (!strncmp(argv[i], "--ring-depth=", 13)) ring_depth = parse_number("--ring-depth", argv[i] + 13, 1, 64);
+        else if (!strcmp(argv[i], "--stats")) print_stats = 1;
+        else if (!strcmp(argv[i], "--calibrate") || !strcmp(argv[i], "--calibrate=stdout")) continue;
+        else if (!strncmp(argv[i], "--output=", 9)) output_path = argv[i] + 9;
+        else if (!strcmp(argv[i], "--direct")) direct_io = 1;
+        else if (!strcmp(argv[i], "--mmap")) mmap_output = 1;
+        else if (!strcmp(argv[i], "--io-uring")) use_uring = 1;
+        else if (!strcmp(argv[i], "--vmsplice")) use_vmsplice = 1;
+        else if (!strcmp(argv[i], "--small-pages")) huge_pages = 0;
+        else if (!strncmp(argv[i], "--affinity=", 11)) affinity_list = argv[i] + 11;
+        else if (!strncmp(argv[i], "--writer-node=", 14)) writer_node = parse_number("--writer-node", argv[i] + 14, 0, 1023);
+        else if (!strcmp(argv[i], "--mmap-flush")) mmap_output = mmap_flush = 1;
+        else if (!strcmp(argv[i], "--mmap-huge")) mmap_output = mmap_huge = 1;
+        else if (!strncmp(argv[i], "--byte-range=", 13))
+        {
+            const char* end;
+            slice_from = parse_offset("--byte-range", argv[i] + 13, &end);
+            if (*end != '-') usage(argv[0]);
+            slice_to = parse_offset("--byte-range", end + 1, &end);
+            if (*end) usage(argv[0]);
+            if (slice_from > slice_to)
+            {
+                fprintf(stderr, "invalid value for --byte-range: '%s' (expected A-B with A <= B)\n", argv[i] + 13);
+                exit(1);
+            }
+            byte_slice = 1;
+            shard_count = 0;
+        }
+        else if (!strncmp(argv[i], "--shard=", 8))
+        {
+            char* end;
+            shard_index = strtoull(argv[i] + 8, &end, 10);
+            if (*end != '/' || end == argv[i] + 8) usage(argv[0]);
+            shard_count = parse_number("--shard", end + 1, 1, 1 << 30);
+            if (shard_index >= shard_count || argv[i][8] == '-')
+            {
+                fprintf(stderr, "invalid value for --shard: '%s' (expected I/N with 0 <= I < N)\n", argv[i] + 8);
+                exit(1);
+            }
+            byte_slice = 1;
+        }
+        else if (!strncmp(argv[i], "--threads=", 10)) num_threads = parse_number("--threads", argv[i] + 10, 1, 4096), threads_given = 1;
+        else if (!strncmp(argv[i], "--lines-per-thread=", 19)) lines_per_thread = parse_number("--lines-per-thread", argv[i] + 19, 300, 1 << 26);
+        else usage(argv[0]);
+    }
+    if (affinity_list) affinity = !strcmp(affinity_list, "compact") ? AFFINITY_COMPACT : !strcmp(affinity_list, "scatter") ? AFFINITY_SCATTER : !strcmp(affinity_list, "none") ? AFFINITY_NONE : AFFINITY_LIST;
+    setup_affinity(affinity_list);
+    if (engine > ENGINE_SCALAR && !rules_fit_shuffles(rules, rule_count))
+    {
+        fprintf(stderr, "the %s engine only supports words made of bytes 1..128\n", ENGINE_NAMES[engine]);
+        exit(1);
+    }
+    generator = generator_create(rules, rule_count, engine);
+    if (unroll) generator->unroll = unroll;
+    const int period = generator->period;
+    if (period)
+    {
+        lines_per_thread -= lines_per_thread % period;
+        if (lines_per_thread < period) lines_per_thread = period;
+    }
+    if (start_line > end_line)
+    {
+        fprintf(stderr, "--start has to be <= --end\n");
+        exit(1);
+    }
+    if (byte_slice && !period)
+    {
+        fprintf(stderr, "--byte-range and --shard need the lcm of the divisors and 100 to be at most %d\n", MAX_PERIOD);
+        exit(1);
+    }
+}
+ 
+void run_chunks_uring(arguments_struct* thread_args) // the io_uring writer: every chunk that's ready goes out in one linked batch, one syscall for all of them
+{
+    slot_struct* batch[URING_ENTRIES];
+    int results[URING_ENTRIES];
+    for (uint64_t chunk = 0; chunk < chunk_count; )
+    {
+        int count = 0;
+        for (; chunk < chunk_count && count < URING_ENTRIES; chunk++, count++)
+        {
+            arguments_struct* args = &thread_args[chunk % num_threads];
+            slot_struct* slot = &args->slots[args->next_push];
+            if (count && !handoff_reached(&slot->filled, slot->pushes + 1)) break; // don't hold back what's ready for what isn't
+            const uint64_t trace = trace_begin();
+            if (handoff_wait(&slot->filled, ++slot->pushes))
+            {
+                writer_waits++;
+                trace_end(TRACE_WAIT_CHUNK, trace);
+            }
+            uring_write(args->thread * ring_depth + args->next_push, slot->buffer, slot->buffer_len, 1);
+            batch[count] = slot;
+            args->next_push = (args->next_push + 1) % ring_depth;
+        }
+        uring.sqes[(*uring.sq_tail - 1) & *uring.sq_mask].flags = 0; // the batch ends the chain
+        const uint64_t trace = trace_begin();
+        uring_complete(count, results);
+        trace_end(TRACE_WRITE, trace);
+        for (int i = 0; i < count; i++)
+        {
+            if (results[i] == -EPIPE) exit(0);
+            if (results[i] < 0 && results[i] != -ECANCELED && results[i] != -EINTR && results[i] != -EAGAIN)
+            {
+                errno = -results[i];
+                perror("io_uring write");
+                exit(1);
+            }
+            const int written = results[i] > 0 ? results[i] : 0;
+            bytes_pushed += written;
+            if (written < batch[i]->buffer_len) output_write(batch[i]->buffer + written, batch[i]->buffer_len - written); // a short write cancels the rest of the chain, they all get finished here in order
+            handoff_post(&batch[i]->released); // the bytes were copied, the worker can have its buffer back right away
+        }
+    }
+}
+ 
+void run_chunks(arguments_struct* thread_args) // the writer: takes the chunks in order, whoever generated them
+{
+    int pending = 0; // slots the pipe may still reference, only with --vmsplice
+    for (uint64_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        arguments_struct* args = &thread_args[chunk % num_threads];
+        slot_struct* slot = &args->slots[args->next_push];
+        uint64_t trace = trace_begin();
+        if (slot->pending) // the worker can't fill it before that, and we are about to wait for it
+        {
+            output_wait_consumed(slot->release);
+            trace_end(TRACE_WAIT_READER, trace);
+            release_slot(slot, slot->release);
+            pending--;
+        }
+        if (pending) // one FIONREAD for all of them
+        {
+            const uint64_t consumed = output_consumed();
+            pending = 0;
+            for (int thread = 0; thread < num_threads; thread++) for (int i = 0; i < ring_depth; i++) pending += release_slot(&thread_args[thread].slots[i], consumed);
+        }
+        trace = trace_begin();
+        if (handoff_wait(&slot->filled, ++slot->pushes))
+        {
+            writer_waits++;
+            trace_end(TRACE_WAIT_CHUNK, trace);
+        }
+        trace = trace_begin();
+        slot->release = output_push(slot->buffer, slot->buffer_len);
+        trace_end(TRACE_WRITE, trace);
+        slot->pending = slot->release != 0;
+        pending += slot->pending;
+        if (!slot->pending) handoff_post(&slot->released); // copied into the pipe, the worker can have it back
+        args->next_push = (args->next_push + 1) % ring_depth;
+    }
+}
+ 
+#define TEMPLATE_LINES 10000 // shorter ranges don't wait for kernels to be generated, the scalar engine patches the digits of one printed block instead (about even with the JIT at 20000)
+#define SINGLE_THREAD_LINES 1000000 // up to here the main thread does it all, spawning workers and faulting in their buffers takes longer than the lines
+#define MIN_WORKER_LINES 250000 // past it, a worker per this many lines at most
+#define SINGLE_CHUNK_BYTES (256 << 10) // per write on the main thread, still in L2 when write() copies it
+ 
+void set_engine(int engine)
+{
+    generator->engine = engine;
+    generator->vector_width = ENGINE_WIDTHS[engine];
+}
+ 
+int jit_widths(int first_width, int last_width) // widths of the range whose kernels would have to be generated, the default rules' are prebuilt
+{
+    int count = 0;
+    for (int width = first_width; generator->period && generator->engine > ENGINE_SCALAR && width <= last_width; width++) count += !kernel_prebuilt(generator, width);
+    return count;
+}
+ 
+int run_single(const char* tail, int tail_len, int line_len, uint64_t trace) // small ranges: no workers, no writer, one buffer for every chunk
+{
+    const int first_width = decimal_width(start_line) < 3 ? 3 : decimal_width(start_line), last_width = decimal_width(end_line);
+    const uint64_t unit = generator->period ? generator->period : 100;
+    if (jit_widths(first_width, last_width) && end_line - start_line < TEMPLATE_LINES) set_engine(ENGINE_SCALAR);
+    else if (jit_widths(first_width, last_width) && generator->engine >= ENGINE_AVX2 && !jit_allowed()) set_engine(engine_supported(ENGINE_SSE41) ? ENGINE_SSE41 : ENGINE_SCALAR);
+    generator->streaming = nt_stores > 0; // the buffer is read right back by write()
+    chunk_lines = SINGLE_CHUNK_BYTES / (line_len + 1) / unit * unit;
+    if (chunk_lines < unit) chunk_lines = unit;
+    chunk_count = (end_line - start_line) / chunk_lines + 1;
+    const size_t bytes = (chunk_lines + unit) * (line_len + 1);
+    char* buffer = malloc(bytes);
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    trace_end(TRACE_SETUP, trace);
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (uint64_t chunk = 0; chunk < chunk_count; chunk++) // kernels are set up as the chunks reach their width
+    {
+        const uint64_t from = chunk_first(chunk), to = chunk + 1 == chunk_count ? end_line : chunk_first(chunk + 1) - 1;
+        const size_t len = generate_range(generator, buffer, from, to) - buffer;
+        trace = trace_begin();
+        output_write(buffer, len);
+        trace_end(TRACE_WRITE, trace);
+    }
+    output_write(tail, tail_len);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (print_stats)
+    {
+        const double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+        fprintf(stderr, "single threaded, %s engine (unroll %d): %" PRIu64 " chunks of up to %" PRIu64 " lines, %s stores, %.2f GB/s\n", ENGINE_NAMES[generator->engine], generator->unroll, chunk_count, chunk_lines, generator->streaming ? "non-temporal" : "cached", bytes_pushed / seconds / 1e9);
+    }
+    return 0;
+}
+ 
+#define CALIBRATE_START 1000000000 // 10 digit lines, like most of any long run
+#define CALIBRATE_LINES 100000000 // per trial, about 0.9 GB
+#define CALIBRATE_TRIALS 2 // the best of them counts
+ 
+double calibrate_trial(char** base, int count, const profile_struct* profile) // GB/s of one setting, 0 if the run failed
+{
+    char threads[32], lines[48], ring[32], nt[32], start[48], end[48];
+    snprintf(threads, sizeof(threads), "--threads=%d", profile->threads);
+    snprintf(lines, sizeof(lines), "--lines-per-thread=%d", profile->lines_per_thread);
+    snprintf(ring, sizeof(ring), "--ring-depth=%d", profile->ring_depth);
+    snprintf(nt, sizeof(nt), "--nt-stores=%s", profile->nt_stores < 0 ? "auto" : profile->nt_stores ? "on" : "off");
+    snprintf(start, sizeof(start), "--start=%d", CALIBRATE_START);
+    snprintf(end, sizeof(end), "--end=%d", CALIBRATE_START + CALIBRATE_LINES - 1);
+    char* args[count + 8];
+    memcpy(args, base, count * sizeof(char*));
+    int n = count;
+    args[n++] = threads;
+    args[n++] = lines;
+    args[n++] = ring;
+    args[n++] = nt;
+    if (profile->io_uring) args[n++] = "--io-uring";
+    args[n++] = start;
+    args[n++] = end;
+    args[n] = NULL;
+    double best = 0;
+    for (int trial = 0; trial < CALIBRATE_TRIALS; trial++)
+    {
+        const int drain = calibrate == 1 && !output_path; // else the run writes to --output or our stdout
+        int out[2];
+        if (drain && pipe(out) != 0)
+        {
+            perror("pipe");
+            return 0;
+        }
+        struct timespec started, finished;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        const pid_t pid = fork(); // a fresh process per setting, every buffer and thread sized from scratch
+        if (pid == 0)
+        {
+            if (drain)
             {
-                if (thread_args[thread].start_number >= line_boundary) continue;
-                pthread_mutex_lock(&thread_args[thread].idle);
-                line_number = thread_args[thread].end_number;
-                fwrite(thread_args[thread].thread_buffer, 1, thread_args[thread].buffer_len, stdout);
-                thread_args[thread].start_number += (runs_per_thread * THREADS_TO_DO * 300);
-                if (thread_args[thread].start_number >= line_boundary) continue;
-                thread_args[thread].end_number = thread_args[thread].start_number + (runs_per_thread * 300);
-                if (thread_args[thread].end_number > line_boundary) thread_args[thread].end_number = line_boundary;
-                thread_args[thread].runs = (thread_args[thread].end_number - thread_args[thread].start_number) / 300;
-                thread_args[thread].buffer_len = thread_args[thread].runs * STRING_LEN;
-                pthread_spin_unlock(&thread_args[thread].work);
+                dup2(out[1], STDOUT_FILENO);
+                close(out[0]);
+                close(out[1]);
             }
+            execv("/proc/self/exe", args);
+            perror("/proc/self/exe");
+            _exit(127);
+        }
+        if (drain) // a reader that only reads, like the simplest consumer
+        {
+            static char sink[1 << 20];
+            close(out[1]);
+            ssize_t n;
+            while ((n = read(out[0], sink, sizeof(sink))) > 0 || (n < 0 && errno == EINTR));
+            close(out[0]);
+        }
+        int status;
+        while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR);
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) return 0;
+        const double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9, rate = fb_bytes(generator, CALIBRATE_START, CALIBRATE_LINES) / seconds / 1e9;
+        if (rate > best) best = rate;
+    }
+    fprintf(stderr, "  %d threads, %d lines per thread, ring depth %d, %s stores%s: %.2f GB/s\n", profile->threads, profile->lines_per_thread, profile->ring_depth, profile->nt_stores < 0 ? "auto" : profile->nt_stores ? "non-temporal" : "cached", profile->io_uring ? ", io_uring" : "", best);
+    return best;
+}
+ 
+void calibrate_try(char** base, int count, const profile_struct* candidate, profile_struct* best, double* best_rate)
+{
+    if (!memcmp(candidate, best, sizeof(profile_struct))) return;
+    const double rate = calibrate_trial(base, count, candidate);
+    if (rate > *best_rate)
+    {
+        *best = *candidate;
+        *best_rate = rate;
+    }
+}
+ 
+int clamp_lines(double lines, int threads) // per thread, a whole number of periods
+{
+    const int unit = generator->period ? generator->period : 100;
+    const double per_thread = lines * threads;
+    return per_thread < unit ? unit : per_thread > (1 << 26) ? (1 << 26) / unit * unit : (int)(per_thread / unit) * unit;
+}
+ 
+int run_calibration(int argc, char** argv) // one setting at a time: chunk size, then threads, ring depth and the store strategy, each around the best so far
+{
+    static const char* const SWEPT[] = { "--calibrate", "--threads=", "--lines-per-thread=", "--ring-depth=", "--nt-stores=", "--io-uring", "--start=", "--end=", "--stats", "--byte-range=", "--shard=" };
+    char** base = malloc(argc * sizeof(char*));
+    int count = 0;
+    base[count++] = argv[0];
+    for (int i = 1; i < argc; i++)
+    {
+        int swept = 0;
+        for (size_t k = 0; k < sizeof(SWEPT) / sizeof(SWEPT[0]); k++) swept |= !strncmp(argv[i], SWEPT[k], strlen(SWEPT[k]));
+        if (!swept) base[count++] = argv[i]; // --rules, --engine, --output... stay as given
+    }
+    cpu_set_t cpus;
+    const int cpu_count = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : sysconf(_SC_NPROCESSORS_ONLN);
+    struct stat st;
+    const int to_file = output_path || (calibrate == 2 && fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)); // io_uring only replaces the pipe writer
+    const long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE), llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    const double line_bytes = (double)fb_bytes(generator, CALIBRATE_START, 300) / 300;
+    fprintf(stderr, "calibrating on %d CPUs, L2 %ld kB, last level cache %ld kB, %d lines per trial into %s:\n", cpu_count, l2 / 1024, llc / 1024, CALIBRATE_LINES, output_path ? output_path : calibrate == 2 ? "stdout" : "a pipe we drain");
+    profile_struct best = { num_threads, lines_per_thread, ring_depth, nt_stores, use_uring }, candidate;
+    double best_rate = calibrate_trial(base, count, &best);
+    const double chunk_bytes[] = { l2 / 2, l2, llc / num_threads / ring_depth, (double)lines_per_thread / num_threads * line_bytes * 4 }; // L2 and LLC sized chunks, and a bigger one than the default
+    for (size_t i = 0; i < sizeof(chunk_bytes) / sizeof(chunk_bytes[0]); i++) if (chunk_bytes[i] > 0)
+    {
+        candidate = best;
+        candidate.lines_per_thread = clamp_lines(chunk_bytes[i] / line_bytes, candidate.threads);
+        calibrate_try(base, count, &candidate, &best, &best_rate);
+    }
+    const double chunk_lines = (double)best.lines_per_thread / best.threads;
+    for (int threads = 1;; threads = threads * 2 < cpu_count ? threads * 2 : cpu_count) // powers of two and all of them
+    {
+        candidate = best;
+        candidate.threads = threads;
+        candidate.lines_per_thread = clamp_lines(chunk_lines, threads); // same chunk size with more or fewer workers
+        calibrate_try(base, count, &candidate, &best, &best_rate);
+        if (threads == cpu_count) break;
+    }
+    for (int depth = 1; depth <= 8; depth *= 2)
+    {
+        candidate = best;
+        candidate.ring_depth = depth;
+        calibrate_try(base, count, &candidate, &best, &best_rate);
+    }
+    for (int uring = 0; uring <= !to_file; uring++) for (int nt = -1; nt <= 1; nt++)
+    {
+        candidate = best;
+        candidate.nt_stores = nt;
+        candidate.io_uring = uring;
+        calibrate_try(base, count, &candidate, &best, &best_rate);
+    }
+    if (best_rate <= 0)
+    {
+        fprintf(stderr, "every calibration run failed, no profile written\n");
+        return 1;
+    }
+    fprintf(stderr, "fastest: %d threads, %d lines per thread, ring depth %d, %s stores%s at %.2f GB/s\n", best.threads, best.lines_per_thread, best.ring_depth, best.nt_stores < 0 ? "auto" : best.nt_stores ? "non-temporal" : "cached", best.io_uring ? ", io_uring" : "", best_rate);
+    save_profile(&best);
+    return 0;
+}
+ 
+int main(int argc, char** argv)
+{
+    parse_options(argc, argv);
+    if (calibrate) return run_calibration(argc, argv);
+    if ((trace_path = getenv("FIZZBUZZ_TRACE")))
+    {
+        trace_tsc = __rdtsc();
+        clock_gettime(CLOCK_MONOTONIC, &trace_time);
+        trace_thread("main", 0); // and the writer, unless the workers write themselves
+        atexit(trace_dump);
+        signal(SIGPIPE, SIG_IGN); // a reader that quits early then ends the run through exit(), which still writes the trace
+    }
+    const uint64_t trace = trace_begin();
+    output_init();
+    char tail[MAX_WORDS + 32]; // the partial last line of a byte slice
+    int tail_len = 0;
+    if (byte_slice && !cut_slice(tail, &tail_len))
+    {
+        output_write(tail, tail_len);
+        return 0;
+    }
+    int line_len = 20; // longest line
+    for (int i = 0, words = 0; i < rule_count; i++) if ((words += rules[i].len) > line_len) line_len = words;
+    const uint64_t lines = end_line - start_line; // one less than the number of lines, which can be 2^64
+    if (!threads_given && lines < SINGLE_THREAD_LINES && !(out_is_file && (mmap_output || direct_fd >= 0))) // --mmap and --direct need the file writers
+    {
+        const char* ignored[] = { use_uring ? "--io-uring" : NULL, affinity != AFFINITY_NONE ? "--affinity" : NULL, use_vmsplice && out_is_pipe ? "--vmsplice" : NULL };
+        for (int i = 0; i < 3; i++) if (ignored[i]) fprintf(stderr, "under %d lines everything runs on the main thread, %s is ignored (--threads=N keeps the workers)\n", SINGLE_THREAD_LINES, ignored[i]);
+        return run_single(tail, tail_len, line_len, trace);
+    }
+    if (!threads_given && lines / MIN_WORKER_LINES + 1 < (uint64_t)num_threads) num_threads = lines / MIN_WORKER_LINES + 1; // a defaulted pool only gets as big as the range
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    const int period = generator->period;
+    const uint64_t unit = period ? period : 100;
+    chunk_lines = lines_per_thread / num_threads / unit * unit;
+    if (lines / num_threads < chunk_lines) chunk_lines = (lines / num_threads + unit) / unit * unit; // short ranges still go to every worker
+    if (chunk_lines < unit) chunk_lines = unit;
+    chunk_count = lines / chunk_lines + 1;
+    file_mode = out_is_file && period; // the offsets come from the seek layer, which needs the period
+    if (file_mode)
+    {
+        start_bytes = bytes_upto(generator, start_line - 1);
+        file_base = lseek(out_fd, 0, SEEK_CUR); // after the partial first line of a slice, if any
+        const uint64_t file_end = file_base + (uint64_t)(bytes_upto(generator, end_line) - start_bytes);
+        fallocate(out_fd, 0, file_base, file_end - file_base + tail_len); // not every filesystem can, pwrite extends the file anyway
+        lseek(out_fd, file_end, SEEK_SET); // the tail and anything after us go behind the workers' bytes
+        if (mmap_output) output_map(file_end);
+    }
+    const uint64_t buffer_lines = out_map ? 0 : chunk_lines + unit; // a mapped output is written in place
+    buffer_bytes = (buffer_lines * (line_len + 1) + DIRECT_ALIGN + 4095) & ~4095;
+    const long llc_bytes = sysconf(_SC_LEVEL3_CACHE_SIZE); // 0 or -1 if glibc can't tell
+    const uint64_t live_bytes = (uint64_t)num_threads * (file_mode ? !out_map : ring_depth) * buffer_bytes; // a buffer is out of the cache again before it's read
+    generator->streaming = nt_stores >= 0 ? nt_stores : out_map || direct_fd >= 0 || (llc_bytes > 0 && live_bytes > (uint64_t)llc_bytes); // page cache only written back, DMA reads
+    arguments_struct* thread_args = aligned_alloc(256, (num_threads * sizeof(arguments_struct) + 255) & ~255);
+    for (int i = 0; i < num_threads; i++)
+    {
+        thread_args[i].thread = i;
+        thread_args[i].next_fill = thread_args[i].next_push = 0;
+        thread_args[i].stalls = 0;
+        thread_args[i].slots = calloc(ring_depth, sizeof(slot_struct)); // every handoff starts at zero
+        atomic_init(&thread_args[i].work.count, 0);
+        atomic_init(&thread_args[i].work.sleepers, 0);
+        atomic_init(&thread_args[i].done.count, 0);
+        atomic_init(&thread_args[i].done.sleepers, 0);
+        atomic_init(&thread_args[i].ready.count, 0);
+        atomic_init(&thread_args[i].ready.sleepers, 0);
+        thread_args[i].cpu = worker_cpu(i);
+        thread_args[i].node = thread_args[i].cpu >= 0 ? cpu_node[thread_args[i].cpu] : -1;
+        thread_args[i].bytes = 0;
+        pthread_create(&threads[i], NULL, thread_func, (void*)(&thread_args[i])); // it pins itself and faults its own buffers in, so they land on its node
+    }
+    const int first_width = decimal_width(start_line) < 3 ? 3 : decimal_width(start_line), last_width = decimal_width(end_line);
+    size_t code_bytes = 0, mask_bytes = 0; // of the kernels that weren't prebuilt, the default rules need none
+    for (int width = first_width; period && generator->engine >= ENGINE_AVX2 && width <= last_width; width++) if (!kernel_prebuilt(generator, width)) code_bytes += kernel_code_bytes(generator, width);
+    if (code_bytes && !jit_allowed()) // W^X policies (SELinux, PaX...) forbid the JIT, the interpreter does the same work
+    {
+        set_engine(engine_supported(ENGINE_SSE41) ? ENGINE_SSE41 : ENGINE_SCALAR);
+        code_bytes = 0;
+    }
+    if (huge_pages) code_bytes = (code_bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1); // hugetlbfs pages can only be mprotected whole
+    for (int width = first_width; period && generator->engine > ENGINE_SCALAR && width <= last_width; width++) if (!kernel_prebuilt(generator, width)) mask_bytes += 2 * kernel_mask_bytes(generator, width);
+    uint8_t* kernels = mask_bytes ? (uint8_t*)alloc_pages("kernel code and masks", code_bytes + mask_bytes, PROT_READ | PROT_WRITE, 0) : NULL; // one mapping keeps the masks in reach of the kernels' rip relative loads
+    generator->code_arena = kernels == MAP_FAILED ? NULL : kernels;
+    generator->mask_arena = kernels == MAP_FAILED ? NULL : kernels + code_bytes; // without them every kernel maps its own
+    for (int width = first_width; period && width <= last_width; width++) generator_kernel(generator, width); // all of them up front, so workers never wait for one to be generated
+    if (generator->code_arena && code_bytes && mprotect(kernels, code_bytes, PROT_READ | PROT_EXEC) != 0) // never writable and executable at once
+    {
+        perror("mprotect kernel code");
+        exit(1);
+    }
+    for (int thread = 0; thread < num_threads; thread++) handoff_wait(&thread_args[thread].ready, 1);
+    trace_end(TRACE_SETUP, trace);
+    if (use_uring && !file_mode) // falls back to the write/vmsplice writer if io_uring isn't there
+    {
+        struct iovec* buffers = malloc(num_threads * ring_depth * sizeof(struct iovec));
+        for (int i = 0; i < num_threads * ring_depth; i++) buffers[i] = (struct iovec){ thread_args[i / ring_depth].slots[i % ring_depth].buffer, buffer_bytes };
+        use_uring = uring_init(buffers, num_threads * ring_depth);
+    }
+    pin_writer();
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (int thread = 0; thread < num_threads; thread++) handoff_post(&thread_args[thread].work);
+    if (file_mode) for (int thread = 0; thread < num_threads; thread++) handoff_wait(&thread_args[thread].done, 1);
+    else if (use_uring) run_chunks_uring(thread_args);
+    else run_chunks(thread_args);
+    output_write(tail, tail_len);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (print_stats)
+    {
+        uint64_t stalls = 0;
+        for (int thread = 0; thread < num_threads; thread++) stalls += thread_args[thread].stalls;
+        fprintf(stderr, "%s writer, ", file_mode ? (out_map ? "mmap" : "pwrite") : use_uring ? (uring.fixed ? "io_uring (fixed buffers)" : "io_uring") : out_is_pipe && use_vmsplice ? "vmsplice" : "write");
+        fprintf(stderr, "%s engine (unroll %d), %d threads, ring depth %d: workers stalled on a full ring %" PRIu64 " times, the writer waited on an empty one %" PRIu64 " times\n", ENGINE_NAMES[generator->engine], generator->unroll, num_threads, ring_depth, stalls, writer_waits);
+        for (int thread = 0; thread < num_threads; thread++) fprintf(stderr, "  worker %d: %" PRIu64 " stalls\n", thread, thread_args[thread].stalls);
+        fprintf(stderr, "  %s stores, %" PRIu64 " kB of buffers per worker, last level cache %ld kB\n", generator->streaming ? "non-temporal" : "cached", (uint64_t)(file_mode ? !out_map : ring_depth) * buffer_bytes / 1024, sysconf(_SC_LEVEL3_CACHE_SIZE) / 1024);
+        const double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+        for (int node = -1; node < node_count; node++) // -1: workers that aren't pinned
+        {
+            uint64_t bytes = 0;
+            int workers = 0;
+            for (int thread = 0; thread < num_threads; thread++) if (thread_args[thread].node == node) bytes += thread_args[thread].bytes, workers++;
+            if (workers) fprintf(stderr, "  %s %d: %d workers, %.2f GB/s\n", node < 0 ? "unpinned, node" : "node", node, workers, bytes / seconds / 1e9);
         }
-        line_boundary *= 10;
+        for (int i = 0; i < page_report_count; i++) fprintf(stderr, "  %s: %zu kB, %zu kB of it on 2 MB pages%s\n", page_reports[i].name, page_reports[i].bytes / 1024, page_reports[i].huge_bytes / 1024, page_reports[i].hugetlb ? " (hugetlbfs)" : huge_pages ? " (THP)" : "");
     }
-    fprintf(stdout, "1000000000\n");
     return 0;
 }
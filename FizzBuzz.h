@@ -0,0 +1,28 @@
+#ifndef FIZZBUZZ_H
+#define FIZZBUZZ_H
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// FizzBuzz as a library (make lib: libfizzbuzz.a and libfizzbuzz.so), the same kernels the program runs, writing
+// into the caller's memory. A handle owns one rule set and its kernels, one per number width, generated the first
+// time a width is needed. Handles share nothing, so any number of them can be used from different threads at once,
+// and a single handle can be shared by threads as well.
+
+#define FB_API __attribute__((visibility("default"))) // the library is built with everything else hidden
+
+typedef struct fb_handle fb_handle;
+
+FB_API fb_handle* fb_create(const uint64_t* divisors, const char* const* words, int count); // count 0: 3 Fizz, 5 Buzz; NULL for more than 16 rules, a divisor of 0 or a word outside 1..256 bytes
+FB_API void fb_destroy(fb_handle* handle);
+
+FB_API uint64_t fb_bytes(fb_handle* handle, uint64_t start_line, uint64_t n_lines); // output bytes of lines start_line .. start_line + n_lines - 1, UINT64_MAX if that's more
+FB_API size_t fb_generate(fb_handle* handle, uint64_t start_line, uint64_t n_lines, char* dst, size_t cap); // as many of those lines as fit into dst[0, cap) whole, returns the bytes written; lines start at 1 and end at 2^64 - 1
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,790 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "Generator.h"
+#include "Encoder.h"
+ 
+// The generator behind both the program and the library: kernels, the slow path and the seek layer of one fb_handle.
+// The JIT itself works in the globals below, so kernels are generated one at a time under generate_lock, whichever
+// handle they belong to; running them only reads the handle.
+ 
+const char* ENGINE_NAMES[] = { "scalar", "sse41", "avx2", "avx512" };
+const int ENGINE_WIDTHS[] = { 0, 16, 32, 64 };
+ 
+alignas(64) static uint8_t ONE[64], VEC_198[64], VEC_246[64]; // 4 lanes, the AVX2 kernel only uses the first two
+static pthread_once_t constants_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t generate_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+static uint8_t* shuffles, * prefix_shuffles; // vector_width bytes each, prefix_shuffles pick the 10^18 and 10^19 digits, only 19 and 20 digit kernels use them
+static int shuffle_idx = 0;
+static int vector_width; // of the handle whose kernel is being generated
+static int digits;
+ 
+static uint8_t* opcode;
+static int8_t* bytecode, * bytecode_ptr;
+static int CODE_SIZE;
+static int segments; // hundreds per block, the number vector moves on after each
+static int unroll_blocks; // blocks per iteration of the kernel's main loop
+ 
+#define DIGIT 0x100  // DIGIT | k: k-th byte of the number vector (10^(k + 2) digit)
+#define PREFIX 0x200 // PREFIX | k: k-th byte of the prefix vector (10^(k + 18) digit)
+static uint16_t* string, * string_ptr; // template of one block, anything below 0x100 is a plain char
+static int string_len; // bytes of one block of the current width
+ 
+__thread trace_struct* trace_local = NULL;
+ 
+const uint64_t POW10[20] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL };
+ 
+int decimal_width(uint64_t n)
+{
+    int width = 1;
+    while (width < 20 && n >= POW10[width]) width++;
+    return width;
+}
+ 
+uint64_t last_of_width(int width)
+{
+    return width == 20 ? UINT64_MAX : POW10[width] - 1;
+}
+ 
+static void set_constants()
+{
+    for (int k = 0; k < 64; k++)
+    {
+        ONE[k] = k % 16 == 0; // 1 in the low qword of every lane
+        VEC_246[k] = 246;
+        VEC_198[k] = 198 - k % 16; // the shuffle index k is subtracted along with the mask, so it's added back here
+    }
+}
+ 
+static void set_number(kernel_state* state, const fb_handle* generator, uint64_t line) // line has to be the first line of a block
+{
+    state->line = line;
+    state->width = decimal_width(line);
+    state->generator = generator;
+    uint64_t hundreds = line / 100 % 10000000000000000ULL, top = line / 1000000000000000000ULL;
+    memset(state->prefix, 0, 64);
+    for (int k = 0; k < 16; k++, hundreds /= 10) state->number[k] = hundreds % 10 + 246;
+    for (int k = 0; k < 2; k++, top /= 10) state->prefix[k] = top % 10 + 176; // vpsubb leaves 0x80 in these bytes, 0x80 + 176 + digit = '0' + digit
+    for (int lane = 16; lane < 64; lane += 16) // vpshufb can't cross lanes, every lane gets its own copy
+    {
+        memcpy(state->number + lane, state->number, 16);
+        memcpy(state->prefix + lane, state->prefix, 16);
+    }
+    memcpy(state->one, ONE, 64);
+    memcpy(state->vec_198, VEC_198, 64);
+    memcpy(state->vec_246, VEC_246, 64);
+}
+ 
+typedef struct {
+    int number[MAX_UNROLL], ascii[MAX_UNROLL]; // the number vector and its ASCII digits, one pair per block in flight
+    int mask; // the shuffle mask of the current store
+    int scratch; // the shuffled prefix digits, the AVX2 carry
+    int prefix, zero, ones; // -1 if this width doesn't need them
+    operand one, vec_198, vec_246; // registers if there are enough of them, the kernel_state otherwise
+    int outputs[32], output_count, next_output; // stores rotate through these, so consecutive ones don't share a register
+    int pinned[32], pinned_count; // the masks of the first stores of a block, loaded once per call instead of once per block
+} kernel_registers;
+ 
+static void allocate_registers(kernel_registers* regs, int evex, int blocks)
+{
+    uint32_t pool = evex ? 0xFFFFFFFF : 0xFFFF;
+    for (int b = 0; b < blocks; b++)
+    {
+        regs->number[b] = take_register(&pool);
+        regs->ascii[b] = take_register(&pool);
+    }
+    regs->mask = take_register(&pool);
+    regs->scratch = take_register(&pool);
+    regs->prefix = digits >= 19 ? take_register(&pool) : -1;
+    regs->zero = digits > 10 ? take_register(&pool) : -1;
+    regs->ones = digits > 10 && evex ? take_register(&pool) : -1;
+    const int constants = __builtin_popcount(pool) >= 3 + 2; // and still two outputs to rotate through
+    regs->one = constants ? vreg(take_register(&pool)) : mem(RDX, 128);
+    regs->vec_198 = constants ? vreg(take_register(&pool)) : mem(RDX, 192);
+    regs->vec_246 = constants ? vreg(take_register(&pool)) : mem(RDX, 256);
+    regs->output_count = regs->next_output = regs->pinned_count = 0;
+    while (regs->output_count < OUTPUT_REGISTERS && pool) regs->outputs[regs->output_count++] = take_register(&pool);
+    for (int reg; (reg = take_register(&pool)) >= 0; ) regs->pinned[regs->pinned_count++] = reg;
+}
+ 
+static void emit_increment(encoder_struct* e, kernel_registers* regs, int b) // on to the next hundred, the decimal carry is done by the 246 bias
+{
+    const int number = regs->number[b];
+    emit_vpaddq(e, number, number, regs->one);
+    if (digits > 10) // the number no longer fits the low qword, carry into the high one by hand
+    {
+        if (e->evex) // EVEX compares only write mask registers, so the carry goes through k1
+        {
+            emit_vpcmpeqq(e, 1, number, vreg(regs->zero));
+            emit_kshiftlw(e, 1, 1, 1);
+            emit_vpsubq(e, number, number, vreg(regs->ones), 1);
+        }
+        else
+        {
+            emit_vpcmpeqq(e, regs->scratch, number, vreg(regs->zero));
+            emit_vpslldq(e, regs->scratch, regs->scratch, 8);
+            emit_vpsubq(e, number, number, vreg(regs->scratch), 0);
+        }
+    }
+    emit_vpmaxub(e, number, number, regs->vec_246);
+    emit_vpsubb(e, regs->ascii[b], number, regs->vec_198);
+}
+ 
+static void emit_blocks(encoder_struct* e, kernel_registers* regs, int blocks) // block after block, so the stores stay in address order
+{
+    for (int b = 0; b < blocks; b++)
+    {
+        uint32_t offset = b * string_len;
+        uint8_t* shuffles_ptr = shuffles;
+        for (int i = 0, store = 0; i < CODE_SIZE; i++)
+        {
+            int8_t c = bytecode[i];
+            if (c == 1 || c == 3)
+            {
+                const int mask = store < regs->pinned_count ? regs->pinned[store] : regs->mask;
+                if (store++ >= regs->pinned_count) emit_vmovdqa(e, mask, rip(shuffles_ptr));
+                if (c == 3) emit_vpshufb(e, regs->scratch, regs->prefix, rip(prefix_shuffles + (shuffles_ptr - shuffles)));
+                const int output = regs->outputs[regs->next_output++ % regs->output_count];
+                emit_vpshufb(e, output, regs->ascii[b], vreg(mask));
+                emit_vpsubb(e, output, output, vreg(mask));
+                if (c == 3) emit_vpaddb(e, output, output, vreg(regs->scratch));
+                emit_vmovdqu_store(e, mem(RDI, offset), output);
+                offset += vector_width;
+                shuffles_ptr += vector_width;
+            }
+            else if (c == 2) emit_increment(e, regs, b);
+            else offset += c;
+        }
+    }
+}
+
+static uint8_t* generate_opcode() // the kernel takes rdi: output, esi: blocks (at least one), rdx: kernel_state and returns the end of the output; returns the end of its code
+{
+    encoder_struct e = { opcode, vector_width == 64 };
+    kernel_registers regs;
+    allocate_registers(&regs, e.evex, unroll_blocks);
+    emit_vmovdqa(&e, regs.number[0], mem(RDX, 0));
+    if (regs.prefix >= 0) emit_vmovdqa(&e, regs.prefix, mem(RDX, 64));
+    if (regs.one.kind == OPERAND_REG)
+    {
+        emit_vmovdqa(&e, regs.one.reg, mem(RDX, 128));
+        emit_vmovdqa(&e, regs.vec_198.reg, mem(RDX, 192));
+        emit_vmovdqa(&e, regs.vec_246.reg, mem(RDX, 256));
+    }
+    if (regs.zero >= 0) emit_vpxor(&e, regs.zero, regs.zero, vreg(regs.zero));
+    if (regs.ones >= 0) emit_vpternlogd(&e, regs.ones, regs.ones, vreg(regs.ones), 0xFF); // all ones
+    emit_vpsubb(&e, regs.ascii[0], regs.number[0], regs.vec_198);
+    for (int i = 0, store = 0; i < CODE_SIZE && store < regs.pinned_count; i++) if (bytecode[i] == 1 || bytecode[i] == 3)
+    {
+        emit_vmovdqa(&e, regs.pinned[store], rip(shuffles + store * vector_width));
+        store++;
+    }
+    uint8_t* done = NULL;
+    if (unroll_blocks > 1)
+    {
+        emit_cmp(&e, RSI, unroll_blocks);
+        uint8_t* single = emit_jcc(&e, JB, NULL);
+        uint8_t* loop = e.ptr;
+        for (int b = 1; b < unroll_blocks; b++) // block b starts where block b - 1 ends, period / 100 hundreds later
+        {
+            emit_vmovdqa(&e, regs.number[b], vreg(regs.number[b - 1]));
+            for (int k = 0; k < segments; k++) emit_increment(&e, &regs, b);
+        }
+        emit_blocks(&e, &regs, unroll_blocks);
+        emit_vmovdqa(&e, regs.number[0], vreg(regs.number[unroll_blocks - 1])); // the last block ended on the first hundred of the next iteration
+        emit_vmovdqa(&e, regs.ascii[0], vreg(regs.ascii[unroll_blocks - 1]));
+        emit_add(&e, RDI, unroll_blocks * string_len);
+        emit_sub(&e, RSI, unroll_blocks);
+        emit_cmp(&e, RSI, unroll_blocks);
+        emit_jcc(&e, JAE, loop);
+        set_jump(single, e.ptr);
+        emit_test(&e, RSI);
+        done = emit_jcc(&e, JE, NULL);
+    }
+    uint8_t* loop = e.ptr; // one block at a time for whatever is left
+    emit_blocks(&e, &regs, 1);
+    emit_add(&e, RDI, string_len);
+    emit_dec(&e, RSI);
+    emit_jcc(&e, JNE, loop);
+    if (done) set_jump(done, e.ptr);
+    emit_mov(&e, RAX, RDI);
+    emit_vzeroupper(&e);
+    emit_ret(&e);
+    return e.ptr;
+}
+
+static void generate_stream(uint8_t* code) // rdi: output, rsi: staging, edx: bytes; both 64 byte aligned, whole lines only
+{
+    encoder_struct e = { code, vector_width == 64 };
+    uint8_t* loop = e.ptr;
+    for (int i = 0; i < 64; i += vector_width) emit_vmovdqa(&e, i / vector_width, mem(RSI, i));
+    for (int i = 0; i < 64; i += vector_width) emit_vmovntdq(&e, mem(RDI, i), i / vector_width);
+    emit_add(&e, RSI, 64);
+    emit_add(&e, RDI, 64);
+    emit_sub(&e, RDX, 64);
+    emit_jcc(&e, JNE, loop);
+    emit_vzeroupper(&e);
+    emit_ret(&e);
+}
+ 
+static void fill_shuffles(int from, int to) // segments are at least 200 bytes, longer than any store
+{
+    for (int i = from; i < to; i += vector_width)
+    {
+        if (i + vector_width > to) // the last store ends right on `to`, going over the end of the one before again, so nothing past the segment is ever stored and blocks can be written in any order
+        {
+            *bytecode_ptr++ = to - (i + vector_width);
+            i = to - vector_width;
+        }
+        int has_prefix = 0;
+        uint8_t* mask = shuffles + shuffle_idx * vector_width, * prefix_mask = prefix_shuffles + shuffle_idx * vector_width;
+        memset(prefix_mask, 0x80, vector_width);
+        for (int j = i; j < i + vector_width; j++)
+        {
+            uint16_t c = string[j];
+            if (c & PREFIX)
+            {
+                mask[j - i] = 0x80;
+                prefix_mask[j - i] = c & 0xFF;
+                has_prefix = 1;
+            }
+            else if (c & DIGIT) mask[j - i] = c & 0xFF;
+            else mask[j - i] = -c; // high bit set, so vpshufb writes a 0 and vpsubb turns it back into c
+        }
+        *bytecode_ptr++ = has_prefix ? 3 : 1;
+        shuffle_idx++;
+    }
+    *bytecode_ptr++ = 2;
+}
+ 
+static int line_word(const fb_handle* generator, char* dst, uint64_t n) // writes the words of line n, returns their length or 0 if it's a number
+{
+    char* start = dst;
+    for (int i = 0; i < generator->rule_count; i++)
+    {
+        if (n % generator->rules[i].divisor) continue;
+        memcpy(dst, generator->rules[i].word, generator->rules[i].len);
+        dst += generator->rules[i].len;
+    }
+    return dst - start;
+}
+ 
+char* write_line(const fb_handle* generator, char* dst, uint64_t n)
+{
+    int len = line_word(generator, dst, n);
+    if (len)
+    {
+        dst[len] = '\n';
+        return dst + len + 1;
+    }
+    char reversed[20];
+    do reversed[len++] = '0' + n % 10; while (n /= 10);
+    while (len) *dst++ = reversed[--len];
+    *dst++ = '\n';
+    return dst;
+}
+ 
+static int block_length(fb_handle* generator, int width) // bytes of one block of `width` digit numbers, the words depend on where the block grid starts; only while kernels are set up
+{
+    if (generator->lengths[width]) return generator->lengths[width];
+    char word[MAX_WORDS];
+    int len = 0;
+    for (int j = 0; j < generator->period; j++)
+    {
+        const int word_len = line_word(generator, word, POW10[width - 1] + j);
+        len += (word_len ? word_len : width) + 1;
+    }
+    return generator->lengths[width] = len;
+}
+ 
+__attribute__((target("sse4.1")))
+static uint8_t* interpret_sse41(uint8_t* dst, int runs, const kernel_state* state) // what the JIT kernel does, one 16 byte shuffle at a time (Intrinsics2 style)
+{
+    __m128i number = _mm_load_si128((const __m128i*)state->number), prefix = _mm_load_si128((const __m128i*)state->prefix);
+    const __m128i one = _mm_load_si128((const __m128i*)state->one), vec_198 = _mm_load_si128((const __m128i*)state->vec_198), vec_246 = _mm_load_si128((const __m128i*)state->vec_246), zero = _mm_setzero_si128();
+    __m128i ascii_number = _mm_sub_epi8(number, vec_198);
+    const kernel_struct* kernel = &state->generator->kernels[state->width];
+    for (; runs > 0; runs--)
+    {
+        const uint8_t* shuffles_ptr = kernel->shuffles;
+        for (int i = 0; i < kernel->code_size; i++)
+        {
+            int8_t c = kernel->bytecode[i];
+            if (c == 1 || c == 3)
+            {
+                const __m128i mask = _mm_load_si128((const __m128i*)shuffles_ptr);
+                __m128i shuffle = _mm_sub_epi8(_mm_shuffle_epi8(ascii_number, mask), mask);
+                if (c == 3) shuffle = _mm_add_epi8(shuffle, _mm_shuffle_epi8(prefix, _mm_load_si128((const __m128i*)(kernel->prefix_shuffles + (shuffles_ptr - kernel->shuffles)))));
+                _mm_storeu_si128((__m128i*)dst, shuffle);
+                dst += 16;
+                shuffles_ptr += 16;
+            }
+            else if (c == 2)
+            {
+                number = _mm_add_epi64(number, one);
+                if (state->width > 10) number = _mm_sub_epi64(number, _mm_slli_si128(_mm_cmpeq_epi64(number, zero), 8));
+                number = _mm_max_epu8(number, vec_246);
+                ascii_number = _mm_sub_epi8(number, vec_198);
+            }
+            else dst += c;
+        }
+    }
+    return dst;
+}
+ 
+static uint8_t* run_scalar(uint8_t* dst, int runs, const kernel_state* state) // the Naive5 digit patching loop: print one block, then copy it and add the period to every number
+{
+    const fb_handle* generator = state->generator;
+    const int period = generator->period, count = generator->numbers_before[period];
+    const uint32_t* hundreds = generator->kernels[state->width].hundreds;
+    const uint64_t printed = hundreds ? (uint64_t)period : (uint64_t)runs * period; // without the offsets (there was no memory for them) every block is printed line by line
+    uint8_t* block = dst;
+    for (uint64_t j = 0; j < printed; j++) dst = (uint8_t*)write_line(generator, (char*)dst, state->line + j);
+    if (!hundreds) return dst;
+    const int len = dst - block, step = period / 100;
+    for (int run = 1; run < runs; run++)
+    {
+        memcpy(dst, dst - len, len);
+        for (int i = 0; i < count; i++)
+        {
+            uint8_t* digit = dst + hundreds[i];
+            for (int carry = step; carry; digit--) // blocks never cross a power of ten, so this can't run off the front of the number
+            {
+                carry += *digit - '0';
+                *digit = '0' + carry % 10;
+                carry /= 10;
+            }
+        }
+        dst += len;
+    }
+    return dst;
+}
+ 
+char* write_lines(const fb_handle* generator, char* dst, uint64_t from, uint64_t to)
+{
+    const uint64_t trace = trace_begin();
+    for (uint64_t n = from; ; n++)
+    {
+        dst = write_line(generator, dst, n);
+        if (n == to) break; // to can be 2^64 - 1
+    }
+    trace_end(TRACE_LINES, trace);
+    return dst;
+}
+ 
+static char* stream_blocks(const fb_handle* generator, const kernel_struct* kernel, char* dst, uint64_t line, uint64_t blocks) // through the staging buffer, so the output's cache lines are written whole and never read for ownership
+{
+    static __thread alignas(64) uint8_t staging[STAGING_BYTES + 64];
+    const uint64_t batch = STAGING_BYTES / kernel->string_len;
+    while (blocks)
+    {
+        const uint64_t n = blocks < batch ? blocks : batch;
+        kernel_state state;
+        set_number(&state, generator, line);
+        uint8_t* src = staging + ((uintptr_t)dst & 63); // at the same offset in its line as dst, so both sides of the copy are aligned
+        const size_t len = kernel->exec(src, n, &state) - src, gap = -(uintptr_t)dst & 63, head = gap < len ? gap : len, lines = (len - head) & ~(size_t)63;
+        memcpy(dst, src, head); // the partial lines at both ends are shared with whatever comes before and after
+        if (lines) kernel->stream((uint8_t*)dst + head, src + head, lines);
+        memcpy(dst + head + lines, src + head + lines, len - head - lines);
+        dst += len;
+        line += n * generator->period;
+        blocks -= n;
+    }
+    _mm_sfence(); // the streaming stores are weakly ordered, they have to be visible before the chunk is handed to another thread
+    return dst;
+}
+ 
+static char* generate_piece(fb_handle* generator, char* dst, int width, uint64_t from, uint64_t to) // inclusive, all of it `width` wide and on the same side of every multiple of 10^18
+{
+    const int period = generator->period;
+    if (width < 3 || !period || to - from < (uint64_t)period - 1) return write_lines(generator, dst, from, to);
+    const kernel_struct* kernel = generator_kernel(generator, width);
+    if (!kernel) return write_lines(generator, dst, from, to); // out of memory for the kernel
+    const uint64_t origin = POW10[width - 1], first = origin + (from - origin + period - 1) / period * period, blocks = (to - first + 1) / period;
+    if (first > from) dst = write_lines(generator, dst, from, first - 1);
+    if (blocks)
+    {
+        const uint64_t trace = trace_begin();
+        if (generator->streaming && kernel->stream && kernel->string_len <= STAGING_BYTES) dst = stream_blocks(generator, kernel, dst, first, blocks);
+        else
+        {
+            kernel_state state;
+            set_number(&state, generator, first);
+            kernel->exec((uint8_t*)dst, blocks, &state);
+            dst += blocks * kernel->string_len;
+        }
+        trace_end(TRACE_KERNEL, trace);
+    }
+    if (first + blocks * period <= to) dst = write_lines(generator, dst, first + blocks * period, to);
+    return dst;
+}
+ 
+char* generate_range(fb_handle* generator, char* dst, uint64_t from, uint64_t to) // a chunk can cross any number of widths, each piece goes to its own kernel
+{
+    while (1)
+    {
+        const int width = decimal_width(from);
+        uint64_t last = last_of_width(width);
+        if (from / POW10[18] < 18 && (from / POW10[18] + 1) * POW10[18] - 1 < last) last = (from / POW10[18] + 1) * POW10[18] - 1; // the 10^18 and 10^19 digits are fixed for a whole kernel call
+        if (last > to) last = to;
+        dst = generate_piece(generator, dst, width, from, last);
+        if (last == to) return dst;
+        from = last + 1;
+    }
+}
+ 
+static void build_seek_tables(fb_handle* generator) // every divisor divides the period, so the word pattern of lines 1..period repeats forever
+{
+    const int period = generator->period;
+    generator->numbers_before = malloc((period + 1) * sizeof(uint32_t));
+    generator->word_bytes_before = malloc((period + 1) * sizeof(uint64_t));
+    generator->numbers_before[0] = generator->word_bytes_before[0] = 0;
+    char word[MAX_WORDS];
+    for (int j = 1; j <= period; j++)
+    {
+        const int word_len = line_word(generator, word, j);
+        generator->numbers_before[j] = generator->numbers_before[j - 1] + !word_len;
+        generator->word_bytes_before[j] = generator->word_bytes_before[j - 1] + word_len;
+    }
+}
+ 
+static uint64_t numbers_upto(const fb_handle* generator, uint64_t n) // lines among 1..n that print their number
+{
+    return n / generator->period * generator->numbers_before[generator->period] + generator->numbers_before[n % generator->period];
+}
+ 
+uint128_t bytes_upto(const fb_handle* generator, uint64_t n)
+{
+    const int period = generator->period;
+    uint128_t bytes = (uint128_t)n + (uint128_t)(n / period) * generator->word_bytes_before[period] + generator->word_bytes_before[n % period]; // newlines and words
+    for (int width = 1; width <= 20 && POW10[width - 1] <= n; width++)
+    {
+        const uint64_t last = last_of_width(width) < n ? last_of_width(width) : n;
+        bytes += (uint128_t)width * (numbers_upto(generator, last) - numbers_upto(generator, POW10[width - 1] - 1));
+    }
+    return bytes;
+}
+ 
+uint64_t line_at(const fb_handle* generator, uint128_t base, uint128_t offset, uint64_t first, uint64_t last)
+{
+    uint64_t lo = first, hi = last;
+    while (lo < hi)
+    {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (bytes_upto(generator, mid) - base > offset) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+ 
+int engine_supported(int e)
+{
+    __builtin_cpu_init();
+    if (e == ENGINE_AVX512) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"); // also checks that the OS saves zmm state
+    if (e == ENGINE_AVX2) return __builtin_cpu_supports("avx2");
+    if (e == ENGINE_SSE41) return __builtin_cpu_supports("sse4.1");
+    return 1;
+}
+ 
+int jit_allowed()
+{
+    void* page = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    const int allowed = page != MAP_FAILED && mprotect(page, 4096, PROT_READ | PROT_EXEC) == 0;
+    if (page != MAP_FAILED) munmap(page, 4096);
+    return allowed;
+}
+ 
+uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+ 
+int rules_fit_shuffles(const rule_struct* rules, int rule_count)
+{
+    for (int i = 0; i < rule_count; i++) for (int k = 0; k < rules[i].len; k++) if ((uint8_t)rules[i].word[k] > 128) return 0;
+    return 1;
+}
+ 
+static int kernel_unroll(const fb_handle* generator, int width)
+{
+    return generator->engine >= ENGINE_AVX2 && block_length((fb_handle*)generator, width) <= UNROLL_MAX_BLOCK ? generator->unroll : 1;
+}
+ 
+static const static_kernel* find_static(const fb_handle* generator, int width)
+{
+#ifndef NO_STATIC_KERNELS
+    if (generator->rule_count != STATIC_RULE_COUNT) return NULL;
+    for (int i = 0; i < STATIC_RULE_COUNT; i++) if (generator->rules[i].divisor != STATIC_RULES[i].divisor || strcmp(generator->rules[i].word, STATIC_RULES[i].word)) return NULL;
+    for (int i = 0; i < STATIC_KERNEL_COUNT; i++) if (STATIC_KERNELS[i].engine == generator->engine && STATIC_KERNELS[i].width == width && STATIC_KERNELS[i].unroll == kernel_unroll(generator, width)) return &STATIC_KERNELS[i];
+#else
+    (void)generator, (void)width; // Prebuild has no kernels to look up yet
+#endif
+    return NULL;
+}
+ 
+int kernel_prebuilt(const fb_handle* generator, int width)
+{
+    return find_static(generator, width) != NULL;
+}
+ 
+size_t kernel_code_bytes(const fb_handle* generator, int width) // 48 bytes cover a store of one block with its mask and prefix, or an increment
+{
+    const size_t stores = block_length((fb_handle*)generator, width) / 16 + 2 * (generator->period / 100) + 16, segments = generator->period / 100, unroll = kernel_unroll(generator, width);
+    const size_t unrolled = unroll > 1 ? unroll * (stores + 2 * segments) * 48 : 0; // the main loop also brings the other blocks' numbers up to date every iteration
+    return ((stores + segments) * 48 + unrolled + 4096 + 4095) & ~4095;
+}
+ 
+size_t kernel_mask_bytes(const fb_handle* generator, int width)
+{
+    return ((block_length((fb_handle*)generator, width) / 16 + 2 * (generator->period / 100) + 16) * (generator->vector_width ? generator->vector_width : 16) + 63) & ~63;
+}
+ 
+static void generate_kernel(fb_handle* generator, uint8_t* code, uint8_t* masks) // template, shuffles and opcode for `digits` wide numbers, generator->kernels[digits] points into code and masks from now on
+{
+    kernel_struct* kernel = &generator->kernels[digits];
+    const int period = generator->period;
+    string_len = kernel->string_len = block_length(generator, digits);
+    if (generator->engine == ENGINE_SCALAR)
+    {
+        kernel->exec = run_scalar;
+        kernel->hundreds = malloc((generator->numbers_before[period] + 1) * sizeof(uint32_t));
+        char word[MAX_WORDS];
+        for (int j = 0, offset = 0, count = 0; kernel->hundreds && j < period; j++) // every block of this width starts at 10^(digits - 1) plus a multiple of the period, so its numbers sit at the same offsets in all of them
+        {
+            const int word_len = line_word(generator, word, POW10[digits - 1] + j);
+            offset += (word_len ? word_len : digits) + 1;
+            if (!word_len) kernel->hundreds[count++] = offset - 4;
+        }
+        return;
+    }
+    vector_width = generator->vector_width;
+    string = realloc(string, (string_len + 64) * sizeof(uint16_t));
+    string_ptr = string;
+    shuffles = masks;
+    prefix_shuffles = masks + kernel_mask_bytes(generator, digits);
+    opcode = code;
+    segments = period / 100;
+    unroll_blocks = kernel_unroll(generator, digits);
+    uint16_t number_template[20], * number_ptr = number_template; // most significant digit first, the last two digits are plain chars
+    for (int k = digits - 3; k >= 0; k--) *number_ptr++ = k >= 16 ? PREFIX | (k - 16) : DIGIT | k;
+    static int segment_ends[MAX_PERIOD / 100]; // under generate_lock
+    for (int j = 0; j < period; j++) // blocks of this width start at 10^(digits - 1) + period * k, which is a whole hundred
+    {
+        char word[MAX_WORDS];
+        const int word_len = line_word(generator, word, POW10[digits - 1] + j);
+        if (word_len) for (int k = 0; k < word_len; k++) *string_ptr++ = (uint8_t)word[k];
+        else
+        {
+            for (int k = 0; k < digits - 2; k++) *string_ptr++ = number_template[k];
+            *string_ptr++ = '0' + j / 10 % 10;
+            *string_ptr++ = '0' + j % 10;
+        }
+        *string_ptr++ = '\n';
+        if (j % 100 == 99) segment_ends[j / 100] = string_ptr - string; // the number vector moves on to the next hundred here
+    }
+    bytecode = kernel->bytecode = malloc(2 * (string_len / 16 + 2 * (period / 100) + 16));
+    bytecode_ptr = bytecode;
+    shuffle_idx = 0;
+    for (int segment = 0; segment < period / 100; segment++) fill_shuffles(segment ? segment_ends[segment - 1] : 0, segment_ends[segment]);
+    CODE_SIZE = kernel->code_size = bytecode_ptr - bytecode;
+    kernel->shuffles = shuffles;
+    kernel->prefix_shuffles = prefix_shuffles;
+    if (generator->engine >= ENGINE_AVX2)
+    {
+        uint8_t* end = generate_opcode();
+        kernel->exec = (opcode_function)opcode;
+        generate_stream(end);
+        kernel->stream = (stream_function)end;
+    }
+    else kernel->exec = interpret_sse41;
+}
+ 
+const kernel_struct* generator_kernel(fb_handle* generator, int width) // NULL if there is no memory for it
+{
+    if (atomic_load_explicit(&generator->generated[width], memory_order_acquire)) return &generator->kernels[width];
+    pthread_mutex_lock(&generate_lock);
+    kernel_struct* kernel = &generator->kernels[width];
+    const static_kernel* prebuilt = find_static(generator, width);
+    if (prebuilt && !atomic_load_explicit(&generator->generated[width], memory_order_relaxed))
+    {
+        kernel->exec = (opcode_function)prebuilt->code;
+        kernel->stream = (stream_function)(prebuilt->code + prebuilt->stream);
+        kernel->shuffles = (uint8_t*)prebuilt->code + prebuilt->shuffles;
+        kernel->prefix_shuffles = (uint8_t*)prebuilt->code + prebuilt->prefix_shuffles;
+        kernel->string_len = generator->lengths[width] = prebuilt->string_len;
+        kernel->prebuilt = 1;
+        atomic_store_explicit(&generator->generated[width], 1, memory_order_release);
+    }
+    if (!atomic_load_explicit(&generator->generated[width], memory_order_relaxed))
+    {
+        const size_t code_bytes = generator->engine >= ENGINE_AVX2 ? kernel_code_bytes(generator, width) : 0, mask_bytes = generator->engine > ENGINE_SCALAR ? 2 * kernel_mask_bytes(generator, width) : 0;
+        uint8_t* code = generator->code_arena, * masks = generator->mask_arena;
+        if (!masks && mask_bytes) // code and masks share a mapping, well within reach of the kernel's rip relative loads
+        {
+            uint8_t* mapping = mmap(NULL, code_bytes + mask_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+            if (mapping == MAP_FAILED) mapping = NULL;
+            kernel->mapping = mapping;
+            kernel->mapping_bytes = code_bytes + mask_bytes;
+            code = mapping;
+            masks = mapping ? mapping + code_bytes : NULL;
+        }
+        if (masks || !mask_bytes)
+        {
+            digits = width;
+            generate_kernel(generator, code, masks);
+            if (generator->mask_arena)
+            {
+                generator->code_arena += code_bytes;
+                generator->mask_arena += mask_bytes;
+            }
+            else if (kernel->mapping) // W^X from here on, the probe in fb_create() made sure we may
+            {
+                if (code_bytes) mprotect(kernel->mapping, code_bytes, PROT_READ | PROT_EXEC);
+                mprotect(kernel->mapping + code_bytes, mask_bytes, PROT_READ);
+            }
+            atomic_store_explicit(&generator->generated[width], 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&generate_lock);
+    return atomic_load_explicit(&generator->generated[width], memory_order_relaxed) ? kernel : NULL;
+}
+ 
+fb_handle* generator_create(const rule_struct* rules, int rule_count, int engine)
+{
+    pthread_once(&constants_once, set_constants);
+    fb_handle* generator = calloc(1, sizeof(fb_handle));
+    if (!generator) return NULL;
+    memcpy(generator->rules, rules, rule_count * sizeof(rule_struct));
+    generator->rule_count = rule_count;
+    uint64_t lcm = 100;
+    for (int i = 0; i < rule_count && lcm <= MAX_PERIOD; i++) lcm = lcm / gcd(lcm, rules[i].divisor) * (rules[i].divisor > MAX_PERIOD ? MAX_PERIOD : rules[i].divisor);
+    generator->period = lcm <= MAX_PERIOD ? lcm : 0;
+    if (engine < 0 && !rules_fit_shuffles(rules, rule_count)) engine = ENGINE_SCALAR; // the scalar engine doesn't care what the words are made of
+    if (engine < 0) for (engine = ENGINE_COUNT - 1; !engine_supported(engine); engine--);
+    generator->engine = engine;
+    generator->vector_width = ENGINE_WIDTHS[engine];
+    generator->unroll = DEFAULT_UNROLL;
+    if (generator->period) build_seek_tables(generator);
+    return generator;
+}
+ 
+fb_handle* fb_create(const uint64_t* divisors, const char* const* words, int count)
+{
+    static const uint64_t default_divisors[] = { 3, 5 };
+    static const char* const default_words[] = { "Fizz", "Buzz" };
+    if (count == 0)
+    {
+        divisors = default_divisors;
+        words = default_words;
+        count = 2;
+    }
+    if (count < 0 || count > 16) return NULL;
+    rule_struct rules[16];
+    for (int i = 0; i < count; i++)
+    {
+        const size_t len = words[i] ? strlen(words[i]) : 0;
+        if (divisors[i] == 0 || len == 0 || len > 256) return NULL;
+        rules[i] = (rule_struct){ divisors[i], words[i], len };
+    }
+    fb_handle* handle = generator_create(rules, count, -1);
+    if (!handle) return NULL;
+    for (int i = 0; i < count; i++) handle->rules[i].word = strdup(words[i]); // the caller's strings may not outlive the handle
+    if (handle->engine >= ENGINE_AVX2 && !kernel_prebuilt(handle, 3) && !jit_allowed()) // the prebuilt kernels cover every width or none, the interpreter does the same work
+    {
+        handle->engine = engine_supported(ENGINE_SSE41) ? ENGINE_SSE41 : ENGINE_SCALAR;
+        handle->vector_width = ENGINE_WIDTHS[handle->engine];
+    }
+    return handle;
+}
+ 
+void fb_destroy(fb_handle* handle)
+{
+    if (!handle) return;
+    for (int width = 0; width <= 20; width++)
+    {
+        if (handle->kernels[width].mapping) munmap(handle->kernels[width].mapping, handle->kernels[width].mapping_bytes);
+        free(handle->kernels[width].bytecode);
+        free(handle->kernels[width].hundreds);
+    }
+    for (int i = 0; i < handle->rule_count; i++) free((char*)handle->rules[i].word);
+    free(handle->numbers_before);
+    free(handle->word_bytes_before);
+    free(handle);
+}
+ 
+static uint64_t last_line(uint64_t start_line, uint64_t n_lines) // of the n_lines starting at start_line, the output ends at 2^64 - 1
+{
+    return n_lines - 1 > UINT64_MAX - start_line ? UINT64_MAX : start_line + (n_lines - 1);
+}
+ 
+static uint64_t multiples_upto(const fb_handle* handle, uint64_t n, int first, uint64_t lcm) // lines among 1..n that are multiples of lcm and of some divisor from rules[first] on, each counted at the last divisor it has
+{
+    uint64_t count = 0;
+    for (int i = first; i < handle->rule_count; i++)
+    {
+        const uint64_t factor = handle->rules[i].divisor / gcd(lcm, handle->rules[i].divisor);
+        if (factor > n / lcm) continue; // no multiple up to n, nor of anything it's combined with further down
+        count += n / (lcm * factor) - multiples_upto(handle, n, i + 1, lcm * factor);
+    }
+    return count;
+}
+ 
+static uint128_t slow_bytes_upto(const fb_handle* handle, uint64_t n) // bytes_upto() without the period tables, for rules whose period is too long for them
+{
+    uint128_t bytes = n;
+    for (int i = 0; i < handle->rule_count; i++) bytes += (uint128_t)handle->rules[i].len * (n / handle->rules[i].divisor);
+    for (int width = 1; width <= 20 && POW10[width - 1] <= n; width++)
+    {
+        const uint64_t last = last_of_width(width) < n ? last_of_width(width) : n, first = POW10[width - 1];
+        bytes += (uint128_t)width * ((last - multiples_upto(handle, last, 0, 1)) - (first - 1 - multiples_upto(handle, first - 1, 0, 1)));
+    }
+    return bytes;
+}
+ 
+uint64_t fb_bytes(fb_handle* handle, uint64_t start_line, uint64_t n_lines)
+{
+    if (!n_lines || !start_line) return 0;
+    const uint64_t last = last_line(start_line, n_lines);
+    const uint128_t bytes = handle->period ? bytes_upto(handle, last) - bytes_upto(handle, start_line - 1) : slow_bytes_upto(handle, last) - slow_bytes_upto(handle, start_line - 1);
+    return bytes > UINT64_MAX ? UINT64_MAX : (uint64_t)bytes;
+}
+ 
+size_t fb_generate(fb_handle* handle, uint64_t start_line, uint64_t n_lines, char* dst, size_t cap)
+{
+    if (!n_lines || !start_line) return 0;
+    uint64_t last = last_line(start_line, n_lines);
+    if (!handle->period) // no seek layer, so line by line until the next one doesn't fit
+    {
+        char line[MAX_WORDS + 32], * p = dst;
+        for (uint64_t n = start_line; ; n++)
+        {
+            if (cap - (p - dst) >= sizeof(line)) p = write_line(handle, p, n);
+            else
+            {
+                const size_t len = write_line(handle, line, n) - line;
+                if (len > cap - (p - dst)) break;
+                memcpy(p, line, len);
+                p += len;
+            }
+            if (n == last) break;
+        }
+        return p - dst;
+    }
+    const uint128_t base = bytes_upto(handle, start_line - 1);
+    uint128_t bytes = bytes_upto(handle, last) - base;
+    if (bytes > cap) // the first line that doesn't fit whole, and everything after it, stays out
+    {
+        last = line_at(handle, base, cap, start_line, last);
+        if (last == start_line) return 0;
+        bytes = bytes_upto(handle, --last) - base;
+    }
+    return generate_range(handle, dst, start_line, last) - dst;
+}
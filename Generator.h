@@ -0,0 +1,150 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "FizzBuzz.h"
+
+// What the program and the library share: the rules, the kernels of every width and the seek layer, all hanging
+// off an fb_handle. The program keeps one for its whole run, the library one per fb_create().
+
+typedef unsigned __int128 uint128_t; // byte offsets: the lines up to 2^64 - 1 are more than 2^64 bytes
+
+enum { ENGINE_SCALAR, ENGINE_SSE41, ENGINE_AVX2, ENGINE_AVX512, ENGINE_COUNT };
+extern const char* ENGINE_NAMES[];
+extern const int ENGINE_WIDTHS[];
+
+#define MAX_PERIOD 1000000 // longer periods don't get a template, everything goes through write_lines()
+#define MAX_WORDS (16 * 256) // longest line without its newline
+#define MAX_UNROLL 4
+#define DEFAULT_UNROLL 1 // blocks per kernel loop iteration, more measured no faster on AVX2 or AVX-512 hosts so far
+#define OUTPUT_REGISTERS 4 // stores rotate through this many, the registers left over hold shuffle masks
+#define STAGING_BYTES 16384 // with streaming: blocks go through a buffer this big, longer ones are stored directly
+#define UNROLL_MAX_BLOCK 16384 // longer blocks stay at one per iteration, unrolling them only multiplies the code
+
+typedef struct {
+    uint64_t divisor;
+    const char* word;
+    int len;
+} rule_struct;
+
+typedef struct {
+    alignas(64) uint8_t number[64];
+    alignas(64) uint8_t prefix[64];
+    alignas(64) uint8_t one[64];
+    alignas(64) uint8_t vec_198[64];
+    alignas(64) uint8_t vec_246[64];
+    uint64_t line; // only the scalar engine needs it as a number
+    int width;
+    const fb_handle* generator; // the interpreters look their tables up in generator->kernels[width]
+} kernel_state; // loaded into registers by the kernel itself
+
+typedef uint8_t* (*opcode_function)(uint8_t*, int, const kernel_state*);
+typedef void (*stream_function)(uint8_t* dst, const uint8_t* src, size_t bytes);
+
+typedef struct {
+    opcode_function exec;
+    stream_function stream; // copies whole 64 byte lines out of the staging buffer with vmovntdq, NULL for the interpreters
+    uint8_t* shuffles, * prefix_shuffles;
+    int8_t* bytecode;
+    uint32_t* hundreds; // scalar engine: offset of the hundreds digit of every number in a block, NULL for the others
+    int code_size;
+    int string_len;
+    uint8_t* mapping; // code and masks of a kernel that didn't come from an arena, unmapped by fb_destroy()
+    size_t mapping_bytes;
+    int prebuilt; // from STATIC_KERNELS, nothing was generated at run time
+} kernel_struct;
+ 
+typedef struct { // a kernel generated at build time by Prebuild, code and masks in one blob in .text
+    int engine, width, unroll;
+    const uint8_t* code; // exec is at the start, the rest rip relative from there
+    uint32_t stream, shuffles, prefix_shuffles; // offsets into code
+    int string_len;
+} static_kernel;
+ 
+#ifndef NO_STATIC_KERNELS // Prebuild itself is built without them
+extern const static_kernel STATIC_KERNELS[];
+extern const int STATIC_KERNEL_COUNT;
+extern const rule_struct STATIC_RULES[]; // the rules they were generated for
+extern const int STATIC_RULE_COUNT;
+#endif
+
+struct fb_handle {
+    rule_struct rules[16]; // a line gets the words of every divisor, in this order, or its number
+    int rule_count;
+    int period; // lines per block: lcm of the divisors and 100, so the block also ends on a whole hundred; 0 if longer than MAX_PERIOD
+    int engine;
+    int vector_width; // bytes per store of the engine
+    int unroll; // blocks in flight per iteration of the JIT kernels, 1..MAX_UNROLL, before any kernel is generated
+    int streaming; // the JIT kernels write into an L1 sized staging buffer that is streamed out with non-temporal stores, for output nobody reads soon
+    kernel_struct kernels[21]; // by width
+    _Atomic int generated[21];
+    int lengths[21]; // bytes of one block of every width, filled in as kernels are set up
+    uint32_t* numbers_before; // numbers_before[j]: lines among 1..j that print their number, j <= period
+    uint64_t* word_bytes_before; // word_bytes_before[j]: bytes of the words among lines 1..j
+    uint8_t* code_arena, * mask_arena; // where the next kernel goes if the owner preallocated them (the program does, on huge pages), else every kernel maps its own
+};
+
+extern const uint64_t POW10[20];
+
+int decimal_width(uint64_t n);
+uint64_t last_of_width(int width);
+int engine_supported(int e);
+int jit_allowed(); // W^X policies (SELinux, PaX...) refuse to make written pages executable
+uint64_t gcd(uint64_t a, uint64_t b);
+int rules_fit_shuffles(const rule_struct* rules, int rule_count); // literal bytes are stored as -c in the masks, which needs the high bit set: 1..128
+
+fb_handle* generator_create(const rule_struct* rules, int rule_count, int engine); // engine -1: the fastest one the CPU supports, the scalar one if the words don't fit the masks
+size_t kernel_code_bytes(const fb_handle* generator, int width); // upper bounds for the regions of one kernel, every engine fits them
+size_t kernel_mask_bytes(const fb_handle* generator, int width);
+const kernel_struct* generator_kernel(fb_handle* generator, int width); // generated on first use, widths 3..20
+int kernel_prebuilt(const fb_handle* generator, int width); // there is a static kernel for it, no code or masks have to be generated
+
+char* write_line(const fb_handle* generator, char* dst, uint64_t n);
+char* write_lines(const fb_handle* generator, char* dst, uint64_t from, uint64_t to); // the slow path for whatever doesn't fill a whole block, inclusive
+char* generate_range(fb_handle* generator, char* dst, uint64_t from, uint64_t to); // inclusive, stores nothing past the last line
+
+uint128_t bytes_upto(const fb_handle* generator, uint64_t n); // output bytes of lines 1..n, needs the period
+uint64_t line_at(const fb_handle* generator, uint128_t base, uint128_t offset, uint64_t first, uint64_t last); // the line in [first, last] holding byte `offset` counted from base = bytes_upto(first - 1)
+
+#define TRACE_EVENTS (1 << 16) // per thread, older events are overwritten but still counted in the totals
+
+enum { TRACE_KERNEL, TRACE_LINES, TRACE_WRITE, TRACE_WAIT_SLOT, TRACE_WAIT_CHUNK, TRACE_WAIT_READER, TRACE_WAIT_WORK, TRACE_SETUP, TRACE_PHASES };
+
+typedef struct {
+    uint64_t begin, end; // tsc
+    int phase;
+} trace_event;
+
+typedef struct {
+    char name[32];
+    uint64_t first, last; // tsc of the first event's begin and the last one's end
+    uint64_t cycles[TRACE_PHASES];
+    uint64_t count;
+    trace_event events[TRACE_EVENTS];
+} trace_struct;
+
+extern __thread trace_struct* trace_local; // NULL unless the program traces, which is all the hot path checks
+
+static inline uint64_t trace_begin()
+{
+    return trace_local ? __rdtsc() : 0;
+}
+
+static inline void trace_end(int phase, uint64_t begin)
+{
+    if (!trace_local) return;
+    const uint64_t end = __rdtsc();
+    trace_event* event = &trace_local->events[trace_local->count++ % TRACE_EVENTS];
+    event->begin = begin;
+    event->end = end;
+    event->phase = phase;
+    trace_local->cycles[phase] += end - begin;
+    if (!trace_local->first) trace_local->first = begin;
+    trace_local->last = end;
+}
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "FizzBuzz.h"
+
+// Checks libfizzbuzz.a against the program: fb_generate and fb_bytes of a few ranges and rule sets have to give
+// exactly what ./FizzBuzz prints for them, and a buffer that is too small has to get the longest run of whole
+// lines that fits, with nothing stored past them. Then threads generate pieces of one range at once, on a handle
+// they share and on one of their own, all of them fresh so that their kernels are generated while the others run.
+
+typedef struct {
+    const char* rules; // --rules of the program, NULL for the default
+    int count;
+    uint64_t divisors[3];
+    const char* words[3];
+    uint64_t start, lines;
+} case_struct;
+
+const case_struct CASES[] = {
+    { NULL, 0, { 0 }, { 0 }, 1, 1000000 },
+    { NULL, 0, { 0 }, { 0 }, 999999999999000000ull, 200000 },
+    { NULL, 0, { 0 }, { 0 }, 18446744073709000000ull, 551616 }, // up to 2^64 - 1
+    { "3:Fizz,5:Buzz,7:Bazz", 3, { 3, 5, 7 }, { "Fizz", "Buzz", "Bazz" }, 95, 1000000 },
+    { "7919:Prime,3:Fizz", 2, { 7919, 3 }, { "Prime", "Fizz" }, 1, 300000 }, // period past MAX_PERIOD, line by line
+};
+
+#define GUARD 4096 // bytes after the cap that have to stay untouched
+#define POISON 0xA5
+
+const char* program = "./FizzBuzz";
+int failures = 0;
+
+char* run_program(const case_struct* c, size_t* len) // everything the program prints for the case
+{
+    char command[512];
+    snprintf(command, sizeof(command), "%s --start=%" PRIu64 " --end=%" PRIu64 "%s%s", program, c->start, c->start + c->lines - 1, c->rules ? " --rules=" : "", c->rules ? c->rules : "");
+    FILE* pipe = popen(command, "r");
+    if (!pipe)
+    {
+        perror(command);
+        exit(2);
+    }
+    size_t cap = 1 << 20, n;
+    char* out = malloc(cap);
+    *len = 0;
+    while ((n = fread(out + *len, 1, cap - *len, pipe)) > 0)
+    {
+        *len += n;
+        if (*len == cap) out = realloc(out, cap *= 2);
+    }
+    if (pclose(pipe))
+    {
+        fprintf(stderr, "%s failed\n", command);
+        exit(2);
+    }
+    return out;
+}
+
+void fail(const case_struct* c, const char* what, size_t cap)
+{
+    fprintf(stderr, "FAIL: lines %" PRIu64 "..%" PRIu64 " rules %s, cap %zu: %s\n", c->start, c->start + c->lines - 1, c->rules ? c->rules : "default", cap, what);
+    failures++;
+}
+
+void check_cap(fb_handle* handle, const case_struct* c, const char* expected, size_t len, size_t cap, char* buffer)
+{
+    size_t fits = cap < len ? cap : len; // the longest run of whole lines within cap
+    while (fits && expected[fits - 1] != '\n') fits--;
+    memset(buffer, POISON, cap + GUARD);
+    const size_t got = fb_generate(handle, c->start, c->lines, buffer, cap);
+    if (got != fits) fail(c, "wrong length", cap);
+    else if (memcmp(buffer, expected, got)) fail(c, "wrong bytes", cap);
+    for (size_t i = got; i < cap + GUARD; i++)
+    {
+        if ((unsigned char)buffer[i] == POISON) continue;
+        fail(c, i < cap ? "stored past the last whole line" : "stored past the cap", cap);
+        break;
+    }
+}
+
+#define THREADS 4
+#define PIECES 200 // per thread and handle
+
+typedef struct {
+    fb_handle* shared, * own;
+    const case_struct* c;
+    const char* expected;
+    const size_t* offsets; // offsets[i]: where line c->start + i begins in expected, one more for the end
+    unsigned seed;
+    int failures;
+} thread_struct;
+
+pthread_barrier_t barrier;
+
+void* run_thread(void* arg)
+{
+    thread_struct* t = arg;
+    const case_struct* c = t->c;
+    char* buffer = malloc(t->offsets[c->lines]);
+    pthread_barrier_wait(&barrier); // all threads hit the first kernels at once
+    for (int i = 0; i < 2 * PIECES; i++)
+    {
+        fb_handle* handle = i & 1 ? t->own : t->shared;
+        const uint64_t first = rand_r(&t->seed) % c->lines, n = 1 + rand_r(&t->seed) % (c->lines - first);
+        const size_t len = t->offsets[first + n] - t->offsets[first];
+        if (fb_generate(handle, c->start + first, n, buffer, len) != len || memcmp(buffer, t->expected + t->offsets[first], len)) t->failures++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+void check_threads(const case_struct* c)
+{
+    size_t len;
+    char* expected = run_program(c, &len);
+    size_t* offsets = malloc((c->lines + 1) * sizeof(size_t));
+    offsets[0] = 0;
+    for (size_t i = 0, line = 1; i < len; i++) if (expected[i] == '\n') offsets[line++] = i + 1;
+    fb_handle* shared = fb_create(c->divisors, c->words, c->count);
+    thread_struct threads[THREADS];
+    pthread_t ids[THREADS];
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    for (int i = 0; i < THREADS; i++)
+    {
+        threads[i] = (thread_struct){ shared, fb_create(c->divisors, c->words, c->count), c, expected, offsets, i + 1, 0 };
+        pthread_create(&ids[i], NULL, run_thread, &threads[i]);
+    }
+    for (int i = 0; i < THREADS; i++)
+    {
+        pthread_join(ids[i], NULL);
+        if (threads[i].failures) fail(c, "wrong output from a thread", 0);
+        fb_destroy(threads[i].own);
+    }
+    pthread_barrier_destroy(&barrier);
+    fb_destroy(shared);
+    free(offsets);
+    free(expected);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) program = argv[1];
+    for (size_t k = 0; k < sizeof(CASES) / sizeof(CASES[0]); k++)
+    {
+        const case_struct* c = &CASES[k];
+        fb_handle* handle = fb_create(c->divisors, c->words, c->count);
+        if (!handle)
+        {
+            fail(c, "fb_create failed", 0);
+            continue;
+        }
+        size_t len;
+        char* expected = run_program(c, &len);
+        char* buffer = malloc(len + GUARD);
+        if (fb_bytes(handle, c->start, c->lines) != len) fail(c, "fb_bytes differs from the program", len);
+        check_cap(handle, c, expected, len, len, buffer);
+        const size_t first = (char*)memchr(expected, '\n', len) - expected + 1;
+        const size_t caps[] = { 0, 1, first - 1, first, first + 1, len / 3, len / 2 + 1, len - 2, len - 1 }; // inside lines and right at their ends
+        for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) check_cap(handle, c, expected, len, caps[i], buffer);
+        srand(k + 1);
+        for (int i = 0; i < 20; i++) check_cap(handle, c, expected, len, ((size_t)rand() << 16 ^ rand()) % len, buffer);
+        free(buffer);
+        free(expected);
+        fb_destroy(handle);
+    }
+    check_threads(&CASES[3]); // not prebuilt, so the kernels are generated under the lock while other threads use the handle
+    if (failures) return 1;
+    fprintf(stderr, "OK: fb_generate matches %s for %zu ranges and %d threads\n", program, sizeof(CASES) / sizeof(CASES[0]), THREADS);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Generator.h"
+
+// Writes Kernels.c to stdout: the avx2 and avx512 kernels of the default rules for every width, made by the same code
+// as the JIT. Each one is a blob in .text, the code followed by its shuffle masks so the rip relative loads still land,
+// and a table points into them. With them the program never writes code at run time, so it needs no writable and
+// executable pages, no MAP_32BIT and can be built as a PIE.
+
+static const rule_struct DEFAULT_RULES[] = { { 3, "Fizz", 4 }, { 5, "Buzz", 4 } };
+
+static uint8_t* generate(int engine, int width, size_t code_bytes, size_t mask_bytes, const kernel_struct** kernel) // code_bytes in front of the masks
+{
+    fb_handle* generator = generator_create(DEFAULT_RULES, 2, engine);
+    uint8_t* blob = aligned_alloc(4096, (code_bytes + mask_bytes + 4095) & ~(size_t)4095);
+    memset(blob, 0, code_bytes + mask_bytes);
+    generator->code_arena = blob;
+    generator->mask_arena = blob + code_bytes;
+    *kernel = generator_kernel(generator, width);
+    return blob;
+}
+
+int main()
+{
+    static const int ENGINES[] = { ENGINE_AVX2, ENGINE_AVX512 };
+    static_kernel table[2 * 21];
+    int count = 0;
+    printf("// Generated by Prebuild, don't edit: the JIT kernels of the default rules, so they don't have to be generated at run time\n");
+    printf("#include \"Generator.h\"\n\n");
+    printf("__asm__(\".pushsection .text.fizzbuzz_kernels,\\\"ax\\\",@progbits\\n\"\n");
+    for (int e = 0; e < 2; e++) for (int width = 3; width <= 20; width++)
+    {
+        fb_handle* sizes = generator_create(DEFAULT_RULES, 2, ENGINES[e]);
+        const size_t code_bytes = kernel_code_bytes(sizes, width), mask_bytes = 2 * kernel_mask_bytes(sizes, width);
+        const kernel_struct* kernel;
+        uint8_t* blob = generate(ENGINES[e], width, code_bytes, mask_bytes, &kernel);
+        size_t code_len = code_bytes;
+        while (code_len && !blob[code_len - 1]) code_len--; // the code ends on a ret, the rest of the bound is zeros
+        code_len = (code_len + 63) & ~(size_t)63;
+        blob = generate(ENGINES[e], width, code_len, mask_bytes, &kernel); // again with the masks right behind the code, the instructions don't change length
+        table[count++] = (static_kernel){ ENGINES[e], width, sizes->unroll, NULL, (uint8_t*)kernel->stream - blob, kernel->shuffles - blob, kernel->prefix_shuffles - blob, kernel->string_len };
+        const size_t blob_bytes = code_len + (width >= 19 ? mask_bytes : mask_bytes / 2); // only 19 and 20 digits use the prefix masks behind the others
+        printf("        \".balign 64\\nfb_kernel_%s_%d:\\n\"\n", ENGINE_NAMES[ENGINES[e]], width);
+        for (size_t i = 0; i < blob_bytes; i += 32)
+        {
+            printf("        \".byte ");
+            for (size_t k = i; k < i + 32 && k < blob_bytes; k++) printf("%s%d", k > i ? "," : "", blob[k]);
+            printf("\\n\"\n");
+        }
+    }
+    printf("        \".popsection\\n\");\n\n");
+    for (int i = 0; i < count; i++) printf("extern const uint8_t fb_kernel_%s_%d[];\n", ENGINE_NAMES[table[i].engine], table[i].width);
+    printf("\nconst static_kernel STATIC_KERNELS[] = {\n");
+    for (int i = 0; i < count; i++) printf("    { %d, %d, %d, fb_kernel_%s_%d, %u, %u, %u, %d },\n", table[i].engine, table[i].width, table[i].unroll, ENGINE_NAMES[table[i].engine], table[i].width, table[i].stream, table[i].shuffles, table[i].prefix_shuffles, table[i].string_len);
+    printf("};\nconst int STATIC_KERNEL_COUNT = %d;\n\n", count);
+    printf("const rule_struct STATIC_RULES[] = { { 3, \"Fizz\", 4 }, { 5, \"Buzz\", 4 } };\nconst int STATIC_RULE_COUNT = 2;\n");
+    return 0;
+}
@@ -151,7 +151,7 @@ int main()
            RUNS_TO_BUFFER = ((current_buffer + BUFFER_SIZE) - buffer_ptr) / THIRD_BOUNDARY + 1;
            RUNS = RUNS_TO_BUFFER < RUNS_TO_DIGIT ? RUNS_TO_BUFFER : RUNS_TO_DIGIT;
            if (RUNS == 0) break;
-           for (int i = 0; i < RUNS; i++) interpret_bytecode();
+           for (uint64_t i = 0; i < RUNS; i++) interpret_bytecode();
            if (buffer_ptr >= current_buffer + BUFFER_SIZE)
            {
                fwrite(current_buffer, 1, buffer_ptr - current_buffer, stdout);
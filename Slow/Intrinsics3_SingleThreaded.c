@@ -18,7 +18,7 @@ const char Fizz[] = "Fizz\n", Buzz[] = "Buzz\n", FizzBuzz[] = "FizzBuzz\n";
 int digits;
 
 uint8_t *opcode, *opcode_ptr;
-typedef uint8_t* (*opcode_function)(uint8_t*, int);
+typedef char* (*opcode_function)(char*, int);
 
 int8_t bytecode[3000], * bytecode_ptr = bytecode;
 
@@ -163,7 +163,7 @@ int main()
         number = _mm256_add_epi8(number, VEC_246);
         ascii_number = _mm256_sub_epi8(number, VEC_198);
         generate_opcode();
-        opcode_function f = opcode;
+        opcode_function f = (opcode_function)opcode;
         uint64_t RUNS, RUNS_TO_DIGIT = (line_boundary - line_number) / 300, RUNS_TO_BUFFER;
         while (1)
         {
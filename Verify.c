@@ -0,0 +1,675 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // Linux 5.14, older kernels reject it and the workers fault the pages in
+#endif
+
+// Checks a FizzBuzz stream (stdin or --input) line by line against the expected value for its line number.
+// There is no reader thread: every worker takes the next chunk ending on a line boundary itself (read into
+// its own buffer, or a range of the mapped --input file), compares it while it's still in its cache and only
+// numbers its lines in order. Chunks are compared against a template of one block (lcm(period, 100) lines,
+// where only the digits above the tens change between blocks), the lowest two of those digits are looked up
+// per hundred with AVX-512 or AVX2 instead of stored into every line. The compare checks 2.3 GB in 0.16s of
+// CPU on one core, where FizzBuzz needs 0.26s to generate them, so the pipe read (the same one cat does) is
+// the only part of Verify that doesn't scale with --threads, and it keeps up wherever cat does.
+
+typedef struct {
+    uint64_t divisor;
+    const char* word;
+    int len;
+} rule_struct;
+
+rule_struct rules[16] = { { 3, "Fizz", 4 }, { 5, "Buzz", 4 } }; // same syntax and order as FizzBuzz --rules
+int rule_count = 2;
+uint64_t start_line = 1, end_line = UINT64_MAX; // inclusive
+int has_end = 0;
+int num_threads = 0;
+const char* input_path = NULL;
+char* input_map = NULL; // a regular file is checked in place instead of read into the workers' buffers
+size_t input_size = 0;
+
+#define CHUNK_BYTES (256 << 10) // read and compared by the same worker, so it's still in its cache
+#define MAP_CHUNK_BYTES (1 << 20) // a mapped input isn't copied, so only the handoffs count
+#define POPULATE_BYTES (16 << 20) // of a mapped input at a time
+#define MAX_LINE (16 * 256 + 1) // longest possible line
+#define MAX_BLOCK 60000 // longer blocks don't get a template, every line is compared on its own
+#define VARY_DIGITS 2 // low digits above the tens that a masked template looks up instead of storing per number
+
+uint64_t block_lines = 0; // lines per template block, 0 if the period is too long
+uint64_t block_groups = 0; // hundreds per block
+
+typedef struct {
+    char* buffer;
+    size_t len; // bytes up to and including the last newline, or everything at EOF
+    uint64_t offset; // in the stream
+} chunk_struct;
+
+// There is no reader thread: every worker reads (or maps) its next chunk itself under input_mutex, which
+// keeps the reads in stream order, and compares it while it's still in its own cache.
+int input_fd;
+uint64_t input_offset = 0, populated = 0; // bytes handed out, bytes of a mapping faulted in
+char* carry; // the partial line after the last chunk read
+size_t carry_len = 0;
+int input_eof = 0;
+uint64_t produced = 0, numbered = 0; // chunks handed out, given their first line
+uint64_t next_line; // first line of the next chunk to be numbered
+pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER, queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunk_numbered = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+    int found;
+    uint64_t offset, line; // byte offset in the stream and line number of the first mismatch
+    char expected[64], got[64];
+} mismatch_struct;
+
+mismatch_struct mismatch = { 0 };
+pthread_mutex_t mismatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char* text; // one block of lines
+    size_t len;
+    int width; // digits of every number in the block
+    uint64_t block; // index of the block text holds
+    char high[MAX_BLOCK / 100][24]; // digits above the tens of every hundred in the block
+    uint32_t* offsets; // where the digits above the tens of each number line start, grouped by hundred
+    uint32_t* line_starts; // of every line and the end of the block, the same for every block of a width
+    uint32_t group_start[MAX_BLOCK / 100 + 1];
+    int vary_digits; // 0 if text is complete, else its last vary_digits digits above the tens are 0 in text and looked up in vary
+    char* index; // per byte of text where that digit is in vary, -128 for the bytes text holds
+    char vary[16]; // those digits of every hundred in the block
+} template_struct;
+
+int (*matches_masked)(const char*, const template_struct*, size_t, size_t) = NULL; // NULL without AVX2, templates are then always complete
+
+const uint64_t POW10[20] = { 1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull };
+
+int digit_count(uint64_t n) // compares only, the divisions it used to do per block cost more than the block's memcmp
+{
+    int digits = 1;
+    while (digits < 20 && n >= POW10[digits]) digits++;
+    return digits;
+}
+
+int is_number(uint64_t n)
+{
+    for (int i = 0; i < rule_count; i++) if (n % rules[i].divisor == 0) return 0;
+    return 1;
+}
+
+int format_line(char* dst, uint64_t n) // expected text of line n including its newline, returns the length
+{
+    char* start = dst;
+    for (int i = 0; i < rule_count; i++)
+    {
+        if (n % rules[i].divisor) continue;
+        memcpy(dst, rules[i].word, rules[i].len);
+        dst += rules[i].len;
+    }
+    if (dst == start)
+    {
+        const int digits = digit_count(n);
+        for (int i = digits - 1; i >= 0; i--, n /= 10) dst[i] = '0' + n % 10;
+        dst += digits;
+    }
+    *dst++ = '\n';
+    return dst - start;
+}
+
+void build_template(template_struct* t, uint64_t block, int width)
+{
+    const uint64_t first = block * block_lines;
+    char* dst = t->text;
+    uint32_t count = 0;
+    for (uint64_t i = 0; i < block_lines; i++)
+    {
+        if (i % 100 == 0) t->group_start[i / 100] = count;
+        if (is_number(first + i)) t->offsets[count++] = dst - t->text;
+        t->line_starts[i] = dst - t->text;
+        const int len = format_line(dst, first + i);
+        dst += len;
+    }
+    t->group_start[block_groups] = count;
+    t->line_starts[block_lines] = dst - t->text;
+    for (uint64_t g = 0; g < block_groups; g++)
+    {
+        uint64_t high = first / 100 + g;
+        for (int k = width - 3; k >= 0; k--, high /= 10) t->high[g][k] = '0' + high % 10;
+    }
+    t->len = dst - t->text;
+    t->width = width;
+    t->block = block;
+    const int high_len = width - 2, vary_digits = high_len < VARY_DIGITS ? high_len : VARY_DIGITS;
+    t->vary_digits = matches_masked && block_groups * vary_digits <= sizeof(t->vary) ? vary_digits : 0;
+    if (!t->vary_digits) return;
+    memset(t->index, -128, t->len);
+    for (uint64_t g = 0; g < block_groups; g++)
+    {
+        for (int d = 0; d < t->vary_digits; d++)
+        {
+            const int j = high_len - t->vary_digits + d;
+            t->vary[g * t->vary_digits + d] = t->high[g][j];
+            for (uint32_t i = t->group_start[g]; i < t->group_start[g + 1]; i++)
+            {
+                t->text[t->offsets[i] + j] = 0;
+                t->index[t->offsets[i] + j] = g * t->vary_digits + d;
+            }
+        }
+    }
+}
+
+void complete_template(template_struct* t) // store the looked up digits back into text, which stays complete until the next build
+{
+    const int high_len = t->width - 2;
+    for (uint64_t g = 0; g < block_groups; g++)
+    {
+        for (int j = high_len - t->vary_digits; j < high_len; j++)
+        {
+            for (uint32_t i = t->group_start[g]; i < t->group_start[g + 1]; i++) t->text[t->offsets[i] + j] = t->high[g][j];
+        }
+    }
+    t->vary_digits = 0;
+}
+
+void advance_template(template_struct* t, uint64_t blocks) // add blocks * block_groups to every hundred and patch only the digits that changed
+{
+    const int high_len = t->width - 2;
+    char* text = t->text;
+    const uint32_t* offsets = t->offsets;
+    for (uint64_t g = 0; g < block_groups; g++)
+    {
+        char* s = t->high[g];
+        uint64_t carry = blocks * block_groups;
+        int k = high_len - 1;
+        for (; carry && k >= 0; k--)
+        {
+            uint64_t v = s[k] - '0' + carry % 10;
+            carry /= 10;
+            if (v >= 10)
+            {
+                v -= 10;
+                carry++;
+            }
+            s[k] = '0' + v;
+        }
+        const int changed = high_len - 1 - k;
+        const uint32_t from = t->group_start[g], to = t->group_start[g + 1];
+        for (int j = high_len - changed; j < high_len - t->vary_digits; j++) // a store per number and changed digit, a memcpy each was most of the time spent
+        {
+            const char digit = s[j];
+            for (uint32_t i = from; i < to; i++) text[offsets[i] + j] = digit;
+        }
+        memcpy(t->vary + g * t->vary_digits, s + high_len - t->vary_digits, t->vary_digits); // the rest is just this
+    }
+    t->block += blocks;
+}
+
+void record_mismatch(const char* chunk, size_t chunk_len, uint64_t chunk_offset, size_t pos, uint64_t line, int end_of_output)
+{
+    pthread_mutex_lock(&mismatch_mutex);
+    if (!mismatch.found || chunk_offset + pos < mismatch.offset)
+    {
+        mismatch.found = 1;
+        mismatch.offset = chunk_offset + pos;
+        mismatch.line = line;
+        if (end_of_output) strcpy(mismatch.expected, "end of output");
+        else
+        {
+            char text[MAX_LINE];
+            const int len = format_line(text, line) - 1;
+            snprintf(mismatch.expected, sizeof(mismatch.expected), "%.*s", len, text);
+        }
+        size_t len = 0;
+        while (pos + len < chunk_len && chunk[pos + len] != '\n' && len < sizeof(mismatch.got) - 1) len++;
+        snprintf(mismatch.got, sizeof(mismatch.got), "%.*s%s", (int)len, chunk + pos, pos == chunk_len ? "<end of output>" : "");
+    }
+    pthread_mutex_unlock(&mismatch_mutex);
+}
+
+__attribute__((target("avx2"))) int matches_masked_avx2(const char* p, const template_struct* t, size_t from, size_t size)
+{
+    const char* text = t->text + from;
+    const char* index = t->index + from;
+    const __m256i vary = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)t->vary)); // pshufb looks up within each half
+    __m256i diff = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i expected = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(text + i)), _mm256_shuffle_epi8(vary, _mm256_loadu_si256((const __m256i*)(index + i))));
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(expected, _mm256_loadu_si256((const __m256i*)(p + i))));
+    }
+    if (!_mm256_testz_si256(diff, diff)) return 0;
+    for (; i < size; i++) if (p[i] != (index[i] < 0 ? text[i] : t->vary[(int)index[i]])) return 0;
+    return 1;
+}
+
+__attribute__((target("avx512bw"))) int matches_masked_avx512(const char* p, const template_struct* t, size_t from, size_t size) // twice as many bytes per instruction, the tail in one masked step
+{
+    const char* text = t->text + from;
+    const char* index = t->index + from;
+    const __m512i vary = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)t->vary));
+    __m512i diff = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128)
+    {
+        const __m512i expected0 = _mm512_or_si512(_mm512_loadu_si512(text + i), _mm512_shuffle_epi8(vary, _mm512_loadu_si512(index + i)));
+        const __m512i expected1 = _mm512_or_si512(_mm512_loadu_si512(text + i + 64), _mm512_shuffle_epi8(vary, _mm512_loadu_si512(index + i + 64)));
+        diff = _mm512_ternarylogic_epi64(diff, expected0, _mm512_loadu_si512(p + i), 0xf6); // diff | (expected ^ p)
+        diff = _mm512_ternarylogic_epi64(diff, expected1, _mm512_loadu_si512(p + i + 64), 0xf6);
+    }
+    for (; i < size; i += 64)
+    {
+        const __mmask64 bytes = size - i >= 64 ? ~0ull : (1ull << (size - i)) - 1;
+        const __m512i expected = _mm512_or_si512(_mm512_maskz_loadu_epi8(bytes, text + i), _mm512_shuffle_epi8(vary, _mm512_mask_loadu_epi8(_mm512_set1_epi8(-128), bytes, index + i))); // 0 past the end, like p
+        diff = _mm512_ternarylogic_epi64(diff, expected, _mm512_maskz_loadu_epi8(bytes, p + i), 0xf6);
+    }
+    return !_mm512_test_epi8_mask(diff, diff);
+}
+
+int matches_template(const char* p, template_struct* t, size_t from, size_t size) // on a mismatch text is complete, to find where
+{
+    if (!t->vary_digits) return !memcmp(p, t->text + from, size);
+    if (matches_masked(p, t, from, size)) return 1;
+    complete_template(t);
+    return 0;
+}
+
+size_t first_difference(const char* a, const char* b, size_t len)
+{
+    size_t i = 0;
+    while (i < len && a[i] == b[i]) i++;
+    return i;
+}
+
+int verify_chunk(const char* p, size_t len, uint64_t* line, template_struct* t, size_t* bad) // starting at *line; on a mismatch returns 0 with its line in *line and position in *bad, else *line is the line after the chunk
+{
+    uint64_t n = *line;
+    size_t pos = 0;
+    while (pos < len)
+    {
+        if (n > end_line || n == 0) break; // output past --end or past 2^64 - 1
+        uint64_t first = block_lines ? n - n % block_lines : 0; // of the block n is in
+        if (block_lines && first >= 100 && end_line - first >= block_lines - 1)
+        {
+            const int width = digit_count(first);
+            const uint64_t last = width < 20 && POW10[width] - 1 < end_line ? POW10[width] - 1 : end_line; // the blocks of one template stay within its width
+            if (last - first >= block_lines - 1)
+            {
+                const uint64_t block = first / block_lines;
+                if (t->width == width && t->block < block) advance_template(t, block - t->block); // also from the previous chunk
+                else if (t->width != width || t->block != block) build_template(t, block, width);
+                const size_t start = pos;
+                size_t from = t->line_starts[n - first]; // chunk edges start and end inside a block
+                while (pos < len) // the rest of this block, then block after block until the chunk, the width or --end runs out
+                {
+                    const size_t size = len - pos < t->len - from ? len - pos : t->len - from;
+                    if (!matches_template(p + pos, t, from, size))
+                    {
+                        size_t line_start = first_difference(p + pos, t->text + from, size);
+                        while (line_start && t->text[from + line_start - 1] != '\n') line_start--;
+                        for (size_t i = 0; i < line_start; i++) n += t->text[from + i] == '\n';
+                        *line = n;
+                        *bad = pos + line_start;
+                        return 0;
+                    }
+                    if (size < t->len - from)
+                    {
+                        uint64_t lo = n - first, hi = block_lines; // the last line that starts within what matched
+                        while (lo < hi)
+                        {
+                            const uint64_t mid = (lo + hi + 1) / 2;
+                            if (t->line_starts[mid] <= from + size) lo = mid;
+                            else hi = mid - 1;
+                        }
+                        pos += t->line_starts[lo] - from; // short of len only when the output ends inside a line
+                        n = first + lo;
+                        break;
+                    }
+                    pos += size;
+                    n = first += block_lines;
+                    from = 0;
+                    if (n == 0 || n > last || last - n < block_lines - 1) break; // past 2^64 - 1, past the width or --end, or the next block doesn't fit
+                    advance_template(t, 1);
+                }
+                if (pos > start) continue;
+            }
+        }
+        char text[MAX_LINE];
+        const int line_len = format_line(text, n);
+        if (len - pos < (size_t)line_len || memcmp(p + pos, text, line_len)) break;
+        pos += line_len;
+        n++;
+    }
+    *line = n;
+    *bad = pos;
+    return pos == len;
+}
+
+int guess_first_line(const char* p, size_t len, uint64_t* first) // from the first number line near the start, 0 if there is none
+{
+    size_t pos = 0;
+    for (uint64_t index = 0; index < 64 && pos < len; index++)
+    {
+        uint64_t n = 0;
+        size_t i = pos;
+        for (; i < len && p[i] >= '0' && p[i] <= '9' && i - pos < 20; i++)
+        {
+            const uint64_t digit = p[i] - '0';
+            if (n > (UINT64_MAX - digit) / 10) break;
+            n = n * 10 + digit;
+        }
+        if (i < len && p[i] == '\n' && i > pos && p[pos] != '0' && n > index)
+        {
+            *first = n - index;
+            return 1;
+        }
+        const char* newline = memchr(p + pos, '\n', len - pos);
+        if (!newline) break;
+        pos = newline - p + 1;
+    }
+    return 0;
+}
+
+uint64_t count_lines_sse2(const char* p, size_t len)
+{
+    uint64_t lines = 0;
+    size_t i = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (i + 16 <= len)
+    {
+        __m128i counts = _mm_setzero_si128(); // per byte, flushed before it can wrap
+        for (int k = 0; k < 255 && i + 16 <= len; k++, i += 16) counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), newline));
+        const __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        lines += _mm_cvtsi128_si64(sums) + _mm_extract_epi16(sums, 4);
+    }
+    for (; i < len; i++) lines += p[i] == '\n';
+    return lines;
+}
+
+__attribute__((target("avx2"))) uint64_t count_lines_avx2(const char* p, size_t len)
+{
+    uint64_t lines = 0;
+    size_t i = 0;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (i + 32 <= len)
+    {
+        __m256i counts = _mm256_setzero_si256();
+        for (int k = 0; k < 255 && i + 32 <= len; k++, i += 32) counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), newline));
+        const __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+        lines += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return lines + count_lines_sse2(p + i, len - i);
+}
+
+uint64_t (*count_lines)(const char*, size_t) = count_lines_sse2;
+
+int next_chunk(chunk_struct* chunk, uint64_t* seq) // the next chunk of the input and its place in it, 0 at the end or once a mismatch is known
+{
+    pthread_mutex_lock(&input_mutex);
+    pthread_mutex_lock(&mismatch_mutex);
+    const int stop = mismatch.found;
+    pthread_mutex_unlock(&mismatch_mutex);
+    size_t filled = 0;
+    if (!stop && !input_eof && input_map)
+    {
+        chunk->buffer = input_map + input_offset;
+        filled = input_size - input_offset < MAP_CHUNK_BYTES ? input_size - input_offset : MAP_CHUNK_BYTES;
+        input_eof = input_offset + filled == input_size;
+        if (input_offset + filled > populated && populated < input_size) // one worker takes the page faults in one go, not each of them one by one
+        {
+            const size_t ahead = input_size - populated < POPULATE_BYTES ? input_size - populated : POPULATE_BYTES;
+            madvise(input_map + populated, ahead, MADV_POPULATE_READ);
+            populated += ahead;
+        }
+    }
+    else if (!stop && !input_eof)
+    {
+        memcpy(chunk->buffer, carry, carry_len);
+        filled = carry_len;
+        while (filled < CHUNK_BYTES)
+        {
+            const ssize_t n = read(input_fd, chunk->buffer + filled, CHUNK_BYTES - filled);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0)
+            {
+                perror("read");
+                exit(2);
+            }
+            if (n == 0)
+            {
+                input_eof = 1;
+                break;
+            }
+            filled += n;
+        }
+    }
+    if (!filled)
+    {
+        pthread_mutex_unlock(&input_mutex);
+        return 0;
+    }
+    const char* last = memrchr(chunk->buffer, '\n', filled);
+    chunk->len = input_eof || !last ? filled : (size_t)(last - chunk->buffer) + 1; // no newline in a whole chunk is a mismatch anyway
+    if (!input_map) // a mapped chunk just starts where the last one ended
+    {
+        carry_len = filled - chunk->len;
+        memcpy(carry, chunk->buffer + chunk->len, carry_len);
+    }
+    chunk->offset = input_offset;
+    input_offset += chunk->len;
+    *seq = produced++;
+    pthread_mutex_unlock(&input_mutex);
+    return 1;
+}
+
+void* worker(void* arg)
+{
+    (void)arg;
+    chunk_struct chunk = { input_map ? NULL : malloc(CHUNK_BYTES), 0, 0 };
+    chunk_struct* slot = &chunk;
+    template_struct* t = calloc(1, sizeof(template_struct));
+    if (block_lines)
+    {
+        t->text = malloc(block_lines * MAX_LINE);
+        t->offsets = malloc(block_lines * sizeof(uint32_t));
+        t->line_starts = malloc((block_lines + 1) * sizeof(uint32_t));
+        t->index = malloc(block_lines * MAX_LINE);
+    }
+    uint64_t seq;
+    while (next_chunk(slot, &seq))
+    {
+        pthread_mutex_lock(&mismatch_mutex);
+        const int skip = mismatch.found && mismatch.offset < slot->offset; // an earlier mismatch is already known
+        pthread_mutex_unlock(&mismatch_mutex);
+        // Chunks are checked in parallel from the line their first number says they start at; numbering them
+        // in order then only has to confirm that it follows the previous chunk. Chunks without a usable number
+        // or with a mismatch are counted and checked again from their real first line.
+        uint64_t guess = 0, next = 0, lines = 0;
+        size_t bad;
+        int guessed = !skip && guess_first_line(slot->buffer, slot->len, &guess);
+        if (guessed)
+        {
+            next = guess;
+            guessed = verify_chunk(slot->buffer, slot->len, &next, t, &bad);
+        }
+        if (!guessed) lines = count_lines(slot->buffer, slot->len);
+        pthread_mutex_lock(&queue_mutex);
+        while (numbered != seq) pthread_cond_wait(&chunk_numbered, &queue_mutex);
+        const uint64_t first = next_line;
+        if (guessed && guess != first)
+        {
+            guessed = 0;
+            lines = count_lines(slot->buffer, slot->len);
+        }
+        next_line = guessed ? next : first + lines;
+        numbered++;
+        pthread_cond_broadcast(&chunk_numbered);
+        pthread_mutex_unlock(&queue_mutex);
+        if (!guessed && !skip)
+        {
+            next = first;
+            if (!verify_chunk(slot->buffer, slot->len, &next, t, &bad)) record_mismatch(slot->buffer, slot->len, slot->offset, bad, next, next - 1 == end_line);
+        }
+    }
+    if (!input_map) free(chunk.buffer);
+    free(t->text);
+    free(t->offsets);
+    free(t->line_starts);
+    free(t->index);
+    free(t);
+    return NULL;
+}
+
+uint64_t parse_line(const char* name, const char* value)
+{
+    char* end;
+    errno = 0;
+    uint64_t n = strtoull(value, &end, 10);
+    if (errno || end == value || *end || *value == '-' || n == 0)
+    {
+        fprintf(stderr, "invalid value for %s: '%s' (expected 1..18446744073709551615)\n", name, value);
+        exit(2);
+    }
+    return n;
+}
+
+void parse_rules(const char* value)
+{
+    rule_count = 0;
+    for (const char* p = value; *p; )
+    {
+        char* end;
+        errno = 0;
+        const uint64_t divisor = strtoull(p, &end, 10);
+        const char* word_end = end + strcspn(end, ",");
+        if (errno || end == p || *p == '-' || divisor == 0 || *end != ':' || word_end == end + 1 || rule_count == 16 || word_end - end > 256)
+        {
+            fprintf(stderr, "invalid value for --rules: '%s' (expected up to 16 DIVISOR:WORD pairs separated by commas)\n", value);
+            exit(2);
+        }
+        rules[rule_count].divisor = divisor;
+        rules[rule_count].word = strndup(end + 1, word_end - end - 1);
+        rules[rule_count].len = word_end - end - 1;
+        rule_count++;
+        p = *word_end ? word_end + 1 : word_end;
+    }
+}
+
+uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b)
+    {
+        const uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strncmp(argv[i], "--start=", 8)) start_line = parse_line("--start", argv[i] + 8);
+        else if (!strncmp(argv[i], "--end=", 6))
+        {
+            end_line = parse_line("--end", argv[i] + 6);
+            has_end = 1;
+        }
+        else if (!strncmp(argv[i], "--rules=", 8)) parse_rules(argv[i] + 8);
+        else if (!strncmp(argv[i], "--threads=", 10)) num_threads = atoi(argv[i] + 10);
+        else if (!strncmp(argv[i], "--input=", 8)) input_path = argv[i] + 8;
+        else
+        {
+            fprintf(stderr, "usage: %s [--start=N] [--end=N] [--rules=D:WORD,...] [--threads=N] [--input=FILE] < output\n"
+                            "checks every line of a FizzBuzz stream, exits with 1 and reports the first mismatch\n", argv[0]);
+            return 2;
+        }
+    }
+    if (start_line > end_line)
+    {
+        fprintf(stderr, "--start has to be <= --end\n");
+        return 2;
+    }
+    if (num_threads < 1)
+    {
+        cpu_set_t set;
+        num_threads = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    }
+    uint64_t lcm = 100; // the template only holds if the rules and the last two digits repeat together
+    for (int i = 0; i < rule_count && lcm <= MAX_BLOCK; i++) lcm = lcm / gcd(lcm, rules[i].divisor) * (rules[i].divisor > MAX_BLOCK ? MAX_BLOCK + 1 : rules[i].divisor);
+    if (lcm <= MAX_BLOCK)
+    {
+        block_lines = lcm;
+        block_groups = lcm / 100;
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        matches_masked = __builtin_cpu_supports("avx512bw") ? matches_masked_avx512 : matches_masked_avx2;
+        count_lines = count_lines_avx2;
+    }
+
+    const int fd = input_fd = input_path ? open(input_path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0)
+    {
+        perror(input_path);
+        return 2;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20); // fails harmlessly if it's not a pipe
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        input_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (input_map == MAP_FAILED) input_map = NULL; // read() it like a pipe
+        else
+        {
+            input_size = st.st_size;
+            madvise(input_map, input_size, MADV_SEQUENTIAL);
+        }
+    }
+    carry = malloc(CHUNK_BYTES);
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    next_line = start_line;
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) pthread_create(&threads[i], NULL, worker, NULL);
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    const uint64_t lines = next_line - start_line;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    const double seconds = finished.tv_sec - started.tv_sec + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    if (!mismatch.found && has_end && lines < end_line - start_line + 1) // everything there was right, but it stopped early
+    {
+        mismatch.found = 1;
+        mismatch.offset = input_offset;
+        mismatch.line = start_line + lines;
+        char text[MAX_LINE];
+        const int len = format_line(text, mismatch.line) - 1;
+        snprintf(mismatch.expected, sizeof(mismatch.expected), "%.*s", len, text);
+        strcpy(mismatch.got, "<end of output>");
+    }
+    if (mismatch.found)
+    {
+        fprintf(stderr, "mismatch at line %" PRIu64 ", byte %" PRIu64 ": expected '%s', got '%s'\n", mismatch.line, mismatch.offset, mismatch.expected, mismatch.got);
+        return 1;
+    }
+    fprintf(stderr, "OK: lines %" PRIu64 "..%" PRIu64 ", %" PRIu64 " bytes in %.3fs (%.2f GB/s)\n", start_line, start_line + lines - 1, input_offset, seconds, input_offset / seconds / 1e9);
+    return 0;
+}